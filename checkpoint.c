@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "checkpoint.h"
+#include "ratelimit.h"
+#include "mem.h"
+
+struct checkpoint_state checkpoint = {NULL, 0, 0, -1, 0, NULL, 0, 0, 0};
+
+
+/*
+ * Write every room of l to a file next to checkpoint.path and move it into
+ * place, so that a crash part way through leaves the last snapshot intact.
+ * Runs in the forked child. Return 0 on success and -1 on failure.
+ */
+int checkpoint_write(struct lobby *l) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d", checkpoint.path, (int)getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror("Opening checkpoint");
+        return -1;
+    }
+
+    struct checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    header.nrooms = l->nrooms;
+    header.dict_size = l->dict.size;
+    header.saved = time(NULL);
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for (int r = 0; r < l->nrooms; r++) {
+        struct game_state *game = l->rooms[r];
+        struct checkpoint_room rec;
+        struct client *p;
+        memset(&rec, 0, sizeof(rec));
+        strcpy(rec.word, game->word);
+        strcpy(rec.guess, game->guess);
+        memcpy(rec.letters_guessed, game->letters_guessed,
+               sizeof(rec.letters_guessed));
+        rec.guesses_left = game->guesses_left;
+        for (p = game->head; p != NULL; p = p->next) {
+            if (!p->dead && p->fd >= 0) {
+                rec.players++;
+            }
+        }
+        // Seats still held from a restore are kept for their owners too.
+        for (int i = 0; i < checkpoint.nheld; i++) {
+            struct reservation *seat = &checkpoint.held[i];
+            if (seat->room == game && !seat->claimed) {
+                rec.players++;
+            }
+        }
+        fwrite(&rec, sizeof(rec), 1, fp);
+        for (p = game->head; p != NULL; p = p->next) {
+            if (!p->dead && p->fd >= 0) {
+                fwrite(p->name, MAX_NAME, 1, fp);
+            }
+        }
+        for (int i = 0; i < checkpoint.nheld; i++) {
+            struct reservation *seat = &checkpoint.held[i];
+            if (seat->room == game && !seat->claimed) {
+                fwrite(seat->name, MAX_NAME, 1, fp);
+            }
+        }
+    }
+
+    if (fflush(fp) == EOF || ferror(fp) || fsync(fileno(fp)) == -1) {
+        perror("Writing checkpoint");
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmp, checkpoint.path) == -1) {
+        perror("rename");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Called at the end of every pass through the event loop. Collect the
+ * child that wrote the last snapshot, and if a room has changed since then
+ * and CHECKPOINT_INTERVAL has passed, fork another. The child has the
+ * rooms as they are now whatever the server does next, so the server goes
+ * straight back to its clients.
+ */
+void checkpoint_tick(struct lobby *l) {
+    int status;
+    if (checkpoint.writer != -1 &&
+        waitpid(checkpoint.writer, &status, WNOHANG) == checkpoint.writer) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Checkpoint %ld failed\n", checkpoint.snapshots);
+        }
+        checkpoint.writer = -1;
+    }
+    if (!checkpoint.dirty || ratelimit_clock < checkpoint.due) {
+        return;
+    }
+    // One snapshot at a time; try again shortly.
+    if (checkpoint.writer != -1) {
+        checkpoint.due = ratelimit_clock + CHECKPOINT_INTERVAL / 10;
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        checkpoint.due = ratelimit_clock + CHECKPOINT_INTERVAL;
+        return;
+    }
+    if (pid == 0) {
+        // _exit, so that the parent's buffered output is not written twice.
+        _exit(checkpoint_write(l) == 0 ? 0 : 1);
+    }
+    checkpoint.writer = pid;
+    checkpoint.dirty = 0;
+    checkpoint.due = ratelimit_clock + CHECKPOINT_INTERVAL;
+    checkpoint.snapshots++;
+}
+
+
+/*
+ * Return the ratelimit_clock time by which the event loop has to wake up
+ * for a snapshot, to collect the child writing one or to let the held
+ * seats go, or -1 if it need not.
+ */
+long checkpoint_deadline() {
+    long deadline = -1;
+    if (checkpoint.path != NULL && checkpoint.dirty) {
+        deadline = checkpoint.due;
+    }
+    long collect = ratelimit_clock + CHECKPOINT_INTERVAL / 10;
+    if (checkpoint.writer != -1 && (deadline == -1 || collect < deadline)) {
+        deadline = collect;
+    }
+    if (checkpoint.held != NULL &&
+        (deadline == -1 || checkpoint.held_until < deadline)) {
+        deadline = checkpoint.held_until;
+    }
+    return deadline;
+}
+
+
+/*
+ * Read the snapshot at checkpoint.path into *rooms and the names of every
+ * room's players, one room after another, into *names. Both are freed by
+ * the caller with mem_free. Return the number of rooms, or -1 if there is
+ * no snapshot or it cannot be used.
+ */
+int checkpoint_load(struct checkpoint_room **rooms,
+                    char (**names)[MAX_NAME], int dict_size) {
+    FILE *fp = fopen(checkpoint.path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    struct checkpoint_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != CHECKPOINT_MAGIC || header.nrooms < 0) {
+        fprintf(stderr, "%s is not a checkpoint\n", checkpoint.path);
+        fclose(fp);
+        return -1;
+    }
+    if (header.dict_size != dict_size) {
+        fprintf(stderr, "%s was taken with a %d word dictionary, not %d\n",
+                checkpoint.path, header.dict_size, dict_size);
+        fclose(fp);
+        return -1;
+    }
+
+    *rooms = mem_calloc(MEM_BUFFERS, header.nrooms + 1,
+                        sizeof(struct checkpoint_room));
+    *names = NULL;
+    int nnames = 0;
+    if (*rooms == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    int r;
+    for (r = 0; r < header.nrooms; r++) {
+        struct checkpoint_room *rec = &(*rooms)[r];
+        if (fread(rec, sizeof(*rec), 1, fp) != 1 || rec->players < 0 ||
+            rec->players > MAX_ROOM_PLAYERS ||
+            rec->word[MAX_WORD - 1] != '\0' ||
+            rec->guess[MAX_WORD - 1] != '\0') {
+            break;
+        }
+        *names = mem_realloc(MEM_BUFFERS, *names,
+                             (nnames + rec->players + 1) * MAX_NAME);
+        if (*names == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        if (fread(*names + nnames, MAX_NAME, rec->players, fp)
+            != (size_t)rec->players) {
+            break;
+        }
+        for (int i = nnames; i < nnames + rec->players; i++) {
+            (*names)[i][MAX_NAME - 1] = '\0';
+        }
+        nnames += rec->players;
+    }
+    fclose(fp);
+    if (r < header.nrooms) {
+        fprintf(stderr, "%s is cut short or damaged\n", checkpoint.path);
+        mem_free(*rooms);
+        mem_free(*names);
+        return -1;
+    }
+    printf("Read a checkpoint of %d rooms taken %lds ago\n", header.nrooms,
+           (long)time(NULL) - header.saved);
+    return header.nrooms;
+}
+
+
+/*
+ * Hold a seat in room for the player called name.
+ */
+void checkpoint_hold(const char *name, struct game_state *room) {
+    if (checkpoint.nheld == checkpoint.held_cap) {
+        checkpoint.held_cap = checkpoint.held_cap > 0
+                              ? checkpoint.held_cap * 2 : 16;
+        checkpoint.held = mem_realloc(MEM_ROOMS, checkpoint.held,
+            checkpoint.held_cap * sizeof(struct reservation));
+        if (checkpoint.held == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct reservation *r = &checkpoint.held[checkpoint.nheld++];
+    strcpy(r->name, name);
+    r->room = room;
+    r->claimed = 0;
+    checkpoint.held_until = ratelimit_clock + CHECKPOINT_GRACE;
+}
+
+
+/*
+ * Return the seat held for the player called name and mark it taken, or
+ * return NULL if none is. Linear, but only while seats are held.
+ */
+struct reservation *checkpoint_claim(const char *name) {
+    for (int i = 0; i < checkpoint.nheld; i++) {
+        struct reservation *r = &checkpoint.held[i];
+        if (!r->claimed && strcmp(r->name, name) == 0) {
+            r->claimed = 1;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Forget every held seat.
+ */
+void checkpoint_release() {
+    mem_free(checkpoint.held);
+    checkpoint.held = NULL;
+    checkpoint.nheld = 0;
+    checkpoint.held_cap = 0;
+}
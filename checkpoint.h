@@ -0,0 +1,68 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <sys/types.h>
+
+#include "gameplay.h"
+#include "lobby.h"
+
+#define CHECKPOINT_MAGIC 0x77736370   // "wscp"
+#define CHECKPOINT_INTERVAL 1000000L  // Microseconds between snapshots
+#define CHECKPOINT_GRACE 60000000L    // How long a restored seat is held
+
+/* A checkpoint file is a checkpoint_header, then for each room a
+ * checkpoint_room followed by the names of its players in list order.
+ * Bots, spectators and players still waiting for a seat are left out.
+ */
+struct checkpoint_header {
+    unsigned int magic;
+    int nrooms;
+    int dict_size;
+    long saved;               // time() when the snapshot was taken
+};
+
+struct checkpoint_room {
+    char word[MAX_WORD];
+    char guess[MAX_WORD];
+    int letters_guessed[NUM_LETTERS];
+    int guesses_left;
+    int players;              // Names that follow this record
+};
+
+/* A seat in a restored room, held for the player who had it until they
+ * come back under the same name or the grace period runs out. The seats
+ * of one room are kept together, in the room's list order.
+ */
+struct reservation {
+    char name[MAX_NAME];
+    struct game_state *room;
+    int claimed;
+};
+
+/* Snapshots are written by a forked child from its copy-on-write view of
+ * the rooms, so the event loop only pays for the fork. A snapshot is taken
+ * at most every CHECKPOINT_INTERVAL and only if a room has changed.
+ */
+struct checkpoint_state {
+    char *path;               // NULL unless the server runs with -S
+    int dirty;                // A room changed since the last snapshot
+    long due;                 // ratelimit_clock when the next may be taken
+    pid_t writer;             // The child writing a snapshot, or -1
+    long snapshots;
+    struct reservation *held; // Seats restored from a snapshot
+    int nheld;
+    int held_cap;
+    long held_until;          // ratelimit_clock when the seats are let go
+};
+
+extern struct checkpoint_state checkpoint;
+
+void checkpoint_tick(struct lobby *l);
+long checkpoint_deadline();
+int checkpoint_load(struct checkpoint_room **rooms,
+                    char (**names)[MAX_NAME], int dict_size);
+void checkpoint_hold(const char *name, struct game_state *room);
+struct reservation *checkpoint_claim(const char *name);
+void checkpoint_release();
+
+#endif
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "cluster.h"
+#include "socket.h"
+#include "upgrade.h"
+#include "ratelimit.h"
+#include "trace.h"
+#include "mem.h"
+
+struct backend backends[CLUSTER_MAX_BACKENDS];
+int num_backends = 0;
+
+/*
+ * Return the number of clients b has or is about to have.
+ */
+long backend_load(struct backend *b) {
+    return b->load.clients + (b->sent - b->load.received);
+}
+
+
+/*
+ * Forget backend i, which has gone away. Its clients went with it, so
+ * they no longer count against their addresses.
+ */
+void remove_backend(int i) {
+    printf("Backend %d has gone (%ld clients sent to it)\n", backends[i].fd,
+           backends[i].sent);
+    close(backends[i].fd);
+    for (int j = 0; j < backends[i].nopen; j++) {
+        ratelimit_release(backends[i].open[j]);
+    }
+    mem_free(backends[i].open);
+    backends[i] = backends[--num_backends];
+}
+
+
+/*
+ * Remember that b has a client from addr.
+ */
+void add_open(struct backend *b, struct in_addr addr) {
+    if (b->nopen == b->open_cap) {
+        b->open_cap = b->open_cap < 64 ? 64 : b->open_cap * 2;
+        b->open = mem_realloc(MEM_CLIENTS, b->open,
+                              b->open_cap * sizeof(struct in_addr));
+        if (b->open == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    b->open[b->nopen++] = addr;
+}
+
+
+/*
+ * Take in report from backend b: its load, and the clients that have
+ * closed, which stop counting against their addresses.
+ */
+void take_report(struct backend *b, struct cluster_report *report) {
+    b->load = report->load;
+    for (int i = 0; i < report->nclosed && i < CLUSTER_CLOSED_BATCH; i++) {
+        in_addr_t addr = report->closed[i].s_addr;
+        // The most recently placed clients are the likeliest to have gone.
+        for (int j = b->nopen - 1; j >= 0; j--) {
+            if (b->open[j].s_addr == addr) {
+                b->open[j] = b->open[--b->nopen];
+                ratelimit_release(report->closed[i]);
+                break;
+            }
+        }
+    }
+}
+
+
+/*
+ * Pass the client clientfd to the least loaded backend, trying the next
+ * one if a backend turns out to have gone or is too far behind to take
+ * the client without making the coordinator wait. A client that no
+ * backend can take is told so and closed.
+ */
+void place_client(int clientfd, struct in_addr addr) {
+    char *unavailable_msg = "No game servers are available right now.\r\n";
+    char busy[CLUSTER_MAX_BACKENDS];
+    struct cluster_client rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ipaddr = addr;
+    memset(busy, 0, sizeof(busy));
+
+    while (1) {
+        int best = -1;
+        for (int i = 0; i < num_backends; i++) {
+            if (!busy[i] && (best == -1 || backend_load(&backends[i]) <
+                                           backend_load(&backends[best]))) {
+                best = i;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        int sent = send_with_fds(backends[best].fd, &rec, sizeof(rec),
+                                 &clientfd, 1);
+        if (sent == 0) {
+            backends[best].sent++;
+            add_open(&backends[best], addr);
+            printf("Sent %s to backend %d\n", inet_ntoa(addr),
+                   backends[best].fd);
+            close(clientfd);
+            return;
+        }
+        if (sent == 1) {
+            busy[best] = 1;
+        } else {
+            // The last backend takes best's place, and its busy flag with it.
+            busy[best] = busy[num_backends - 1];
+            remove_backend(best);
+        }
+    }
+    send(clientfd, unavailable_msg, strlen(unavailable_msg), MSG_DONTWAIT);
+    close(clientfd);
+    ratelimit_release(addr);
+}
+
+
+/*
+ * Print every backend and its load.
+ */
+void dump_backends(FILE *fp) {
+    fprintf(fp, "%-8s %8s %8s %8s %8s %10s\n", "backend", "clients",
+            "players", "rooms", "sent", "received");
+    for (int i = 0; i < num_backends; i++) {
+        struct backend *b = &backends[i];
+        fprintf(fp, "%-8d %8d %8d %8d %8ld %10ld\n", b->fd, b->load.clients,
+                b->load.players, b->load.rooms, b->sent, b->load.received);
+    }
+    fflush(fp);
+}
+
+
+/*
+ * Run as the coordinator of a cluster: accept players on listenfd and
+ * backends on the Unix domain socket path, and hand each player's socket
+ * descriptor to the backend with the fewest clients. The coordinator
+ * applies the connection limits, counting each client until its backend
+ * reports it closed; the game is left to the backends.
+ */
+void run_coordinator(char *path, int listenfd) {
+    struct pollfd fds[CLUSTER_MAX_BACKENDS + 2];
+    int unixfd = upgrade_listen(path);
+    printf("Coordinating backends on %s\n", path);
+
+    while (1) {
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            dump_backends(stderr);
+            mem_dump(stderr);
+        }
+
+        fds[0].fd = listenfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = unixfd;
+        fds[1].events = POLLIN;
+        for (int i = 0; i < num_backends; i++) {
+            fds[i + 2].fd = backends[i].fd;
+            fds[i + 2].events = POLLIN;
+        }
+        int nfds = num_backends + 2;
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        ratelimit_tick();
+
+        // Backends first, so that a load report or a departure is taken
+        // into account before any new player is placed.
+        for (int i = nfds - 1; i >= 2; i--) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            struct backend *b = &backends[i - 2];
+            struct cluster_report report;
+            if (recv(b->fd, &report, sizeof(report), 0) == sizeof(report)) {
+                take_report(b, &report);
+            } else {
+                remove_backend(i - 2);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(unixfd, NULL, NULL);
+            if (fd < 0) {
+                perror("accept");
+            } else if (num_backends == CLUSTER_MAX_BACKENDS) {
+                fprintf(stderr, "Too many backends\n");
+                close(fd);
+            } else {
+                struct backend *b = &backends[num_backends++];
+                memset(b, 0, sizeof(*b));
+                b->fd = fd;
+                // Handing a client over must never wait on a backend that
+                // is behind; place_client tries another one instead.
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                printf("Backend %d has joined\n", fd);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct in_addr addr;
+            int clientfd = accept_connection(listenfd, &addr);
+            if (clientfd == -1) {
+                continue;
+            }
+            // The connection stays counted against addr until the backend
+            // it is placed on reports it closed, or goes away.
+            if (ratelimit_connect(addr) == -1) {
+                char *refused_msg = "Too many connections from your "
+                                    "address. Try again later.\r\n";
+                printf("Refusing connection from %s (%ld refused)\n",
+                       inet_ntoa(addr), rate_stats.refused_connections);
+                send(clientfd, refused_msg, strlen(refused_msg),
+                     MSG_DONTWAIT);
+                close(clientfd);
+                continue;
+            }
+            place_client(clientfd, addr);
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include <netinet/in.h>
+
+#define CLUSTER_MAX_BACKENDS 64
+#define CLUSTER_CLOSED_BATCH 32   // Closed clients told of in one report
+
+/* Sent by the coordinator to a backend, with the client's socket
+ * descriptor attached.
+ */
+struct cluster_client {
+    struct in_addr ipaddr;
+};
+
+/* Sent by a backend to the coordinator whenever its load changes. */
+struct cluster_load {
+    int clients;      // Clients connected, in any list
+    int players;      // Clients playing
+    int rooms;        // Rooms open
+    long received;    // Clients ever received from the coordinator
+};
+
+/* Sent by a backend to the coordinator whenever its load changes or some
+ * of its clients have closed, so that the coordinator can stop counting
+ * them against their addresses' MAX_CONNS_PER_IP.
+ */
+struct cluster_report {
+    struct cluster_load load;
+    int nclosed;
+    struct in_addr closed[CLUSTER_CLOSED_BATCH];
+};
+
+/* A backend as the coordinator sees it. The coordinator places each new
+ * client on the backend with the fewest clients, counting the ones it has
+ * sent that the backend had not received when it last reported. It also
+ * keeps the address of every client the backend has not yet reported
+ * closed, to stop counting them all if the backend goes away.
+ */
+struct backend {
+    int fd;
+    struct cluster_load load;
+    long sent;        // Clients ever sent to this backend
+    struct in_addr *open;
+    int nopen;
+    int open_cap;
+};
+
+void run_coordinator(char *path, int listenfd);
+
+#endif
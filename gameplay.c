@@ -2,9 +2,201 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "gameplay.h"
 
+/* Add an event to ev. */
+static void add_event(struct game_events *ev, int type, int detail,
+                      char letter, struct client *player) {
+    if (ev->n < MAX_GAME_EVENTS) {
+        struct game_event *e = &ev->ev[ev->n++];
+        e->type = type;
+        e->detail = detail;
+        e->letter = letter;
+        e->player = player;
+    }
+}
+
+/* Start a new game of game with word, keeping its players and whoever has
+ * the turn.
+ */
+void game_start(struct game_state *game, const char *word) {
+    strncpy(game->word, word, MAX_WORD);
+    game->word[MAX_WORD-1] = '\0';
+    int len = strlen(game->word);
+    memset(game->guess, '-', len);
+    game->guess[len] = '\0';
+    memset(game->letters_guessed, 0, sizeof(game->letters_guessed));
+    game->guesses_left = MAX_GUESSES;
+}
+
+/* Return 1 if the word has been guessed or the guesses have run out.
+ */
+int game_over(struct game_state *game) {
+    return game->guesses_left <= 0 || strcmp(game->word, game->guess) == 0;
+}
+
+/* Seat p at the head of game's players. The first player in an empty game
+ * gets the turn. Whoever has the turn is not told; game_turn does that.
+ */
+void game_join(struct game_state *game, struct client *p,
+               struct game_events *ev) {
+    p->next = game->head;
+    game->head = p;
+    p->room = game;
+    if (game->has_next_turn == NULL) {
+        game->has_next_turn = p;
+    }
+    add_event(ev, GAME_JOINED, 0, 0, p);
+}
+
+/* Unlink p, one of game's players, handing the turn on first if p has it:
+ * to the nearest player before them who is still connected, or to nobody.
+ * p->next is left NULL. Whoever has the turn now is not told; game_turn
+ * does that, once for however many players leave together.
+ */
+void game_leave(struct game_state *game, struct client *p,
+                struct game_events *ev) {
+    if (game->has_next_turn == p) {
+        struct client *q = p;
+        do {
+            q = player_before(game, q);
+        } while (q != p && q->dead);
+        game->has_next_turn = q == p ? NULL : q;
+    }
+    struct client **curr_p;
+    for (curr_p = &game->head; *curr_p != p; curr_p = &(*curr_p)->next)
+        ;
+    *curr_p = p->next;
+    p->next = NULL;
+    add_event(ev, GAME_LEFT, 0, 0, p);
+}
+
+/* Apply line, sent by player p, as a guess. A line that is not a valid
+ * guess from the player with the turn is refused and changes nothing.
+ * A letter in the word keeps the turn with p; any other passes it on.
+ */
+void game_guess(struct game_state *game, struct client *p, const char *line,
+                struct game_events *ev) {
+    if (game->has_next_turn != p) {
+        add_event(ev, GAME_REFUSED, REFUSED_NOT_TURN, 0, p);
+        return;
+    }
+    int len = strlen(line);
+    if (len == 0) {
+        add_event(ev, GAME_REFUSED, REFUSED_EMPTY, 0, p);
+        return;
+    }
+    if (len > 1) {
+        add_event(ev, GAME_REFUSED, REFUSED_LENGTH, 0, p);
+        return;
+    }
+    char letter = line[0];
+    if (!islower((unsigned char)letter)) {
+        add_event(ev, GAME_REFUSED, REFUSED_CASE, 0, p);
+        return;
+    }
+    if (game->letters_guessed[letter - 'a']) {
+        add_event(ev, GAME_REFUSED, REFUSED_REPEAT, letter, p);
+        return;
+    }
+
+    int in_word = 0;
+    for (int j = 0; game->word[j] != '\0'; j++) {
+        if (game->word[j] == letter) {
+            in_word = 1;
+            game->guess[j] = letter;
+        }
+    }
+    game->guesses_left -= 1;
+    game->letters_guessed[letter - 'a'] = 1;
+    add_event(ev, GAME_GUESSED, in_word, letter, p);
+
+    if (in_word || game_over(game)) {
+        game_turn(game, ev);
+    } else {
+        game_advance(game, ev);
+    }
+}
+
+/* Pass the turn over without a guess, charging the game a guess for it if
+ * costs_guess is set.
+ */
+void game_skip(struct game_state *game, int costs_guess,
+               struct game_events *ev) {
+    if (costs_guess) {
+        game->guesses_left -= 1;
+    }
+    if (game_over(game)) {
+        game_turn(game, ev);
+    } else {
+        game_advance(game, ev);
+    }
+}
+
+/* Pass the turn to the connected player before the one who has it,
+ * wrapping around from the head of the list to the tail, and say who has
+ * it.
+ */
+void game_advance(struct game_state *game, struct game_events *ev) {
+    int players = count_players(game);
+    if (players > 1) {
+        struct client *p = game->has_next_turn;
+        do {
+            p = player_before(game, p);
+        } while (p->dead);
+        game->has_next_turn = p;
+    }
+    if (players >= 1) {
+        game_turn(game, ev);
+    }
+}
+
+/* Say who has the turn or, if the game is over, how it ended. An ended
+ * game stays over until the caller starts a new one with game_start.
+ */
+void game_turn(struct game_state *game, struct game_events *ev) {
+    struct client *p = game->has_next_turn;
+    if (p == NULL) {
+        return;
+    }
+    if (!game_over(game)) {
+        add_event(ev, GAME_TURN, 0, 0, p);
+    } else if (strcmp(game->word, game->guess) == 0) {
+        add_event(ev, GAME_WON, 0, 0, p);
+    } else {
+        add_event(ev, GAME_LOST, 0, 0, p);
+    }
+}
+
+/* Count the players in game, not counting any who have disconnected but
+ * not been unlinked yet.
+ */
+int count_players(struct game_state *game) {
+    struct client *p;
+    int num_players = 0;
+    for (p = game->head; p != NULL; p = p->next) {
+        if (!p->dead) {
+            num_players += 1;
+        }
+    }
+    return num_players;
+}
+
+/* Return the player before p in the game list. The player before the head
+ * of the list is the one in the tail.
+ */
+struct client *player_before(struct game_state *game, struct client *p) {
+    struct client *c;
+    if (p == game->head) {
+        for (c = game->head; c->next != NULL; c = c->next);
+    } else {
+        for (c = game->head; c->next != p; c = c->next);
+    }
+    return c;
+}
+
 /* Return a status message that shows the current state of the game.
  * Assumes that the caller has allocated MAX_MSG bytes for msg.
  */
@@ -60,18 +252,7 @@ void init_game(struct game_state *game, char *dict_name) {
     } else {
         fprintf(stderr, "The dictionary file does not appear to have Unix line endings\n");
     }
-    strncpy(game->word, buf, MAX_WORD);
-    game->word[MAX_WORD-1] = '\0';
-    for(int j = 0; j < strlen(game->word); j++) {
-        game->guess[j] = '-';
-    }
-    game->guess[strlen(game->word)] = '\0';
-
-    for(int i = 0; i < NUM_LETTERS; i++) {
-        game->letters_guessed[i] = 0;
-    }
-    game->guesses_left = MAX_GUESSES;
-
+    game_start(game, buf);
 }
 
 
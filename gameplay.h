@@ -1,20 +1,47 @@
+#ifndef _GAMEPLAY_H_
+#define _GAMEPLAY_H_
+
 #include <netinet/in.h>
 
+#include "socket.h"
+#include "ratelimit.h"
+#include "timer.h"
+
 #define MAX_NAME 30
 #define MAX_MSG 128
 #define MAX_WORD 20
 #define MAX_BUF 256
 #define MAX_GUESSES 4
 #define NUM_LETTERS 26
-#define WELCOME_MSG "Welcome to our word game. What is your name? "
+#define SPECTATE_CMD "watch"
+#define HINT_CMD "hint"
+#define WELCOME_MSG "Welcome to our word game. What is your name? " \
+                    "(Enter \"" SPECTATE_CMD "\" to spectate.) "
 
+struct game_state;
+
+/* One connection. The first 64 bytes hold what every broadcast and every
+ * walk over the clients reads; the rest is only read while handling the
+ * client's own input. Clients come from a pool, so the ones in use sit
+ * next to each other in memory.
+ */
 struct client {
+    struct client *next;
     int fd;
+    char dead;            // Disconnected; removed at the end of the tick
+    char watching;        // A spectator of room rather than a player
+    unsigned char missed; // Turns in a row the player let run out
+    char pending;         // Listed among the clients with output waiting
+    struct outqueue out;  // Messages waiting to be sent
+    struct game_state *room;  // The room the client is in, or NULL if none
+    void *io;             // Per-connection state of the I/O backend, if any
     struct in_addr ipaddr;
-    struct client *next;
+
+    int inlen;            // Bytes of a partial line waiting in inbuf
+    char *inbuf;          // MAX_BUF bytes from the input buffer pool while
+                          // a partial line is waiting, otherwise NULL
     char name[MAX_NAME];
-    char inbuf[MAX_BUF];  // Used to hold input from the client
-    char *in_ptr;         // A pointer into inbuf to help with partial reads
+    struct token_bucket lines;  // Limits how fast lines are handled
 };
 
 // Information about the dictionary used to pick random word
@@ -23,6 +50,7 @@ struct dictionary {
     int size;
 };
 
+/* One room: a game with its own word, players and spectators. */
 struct game_state {
     char word[MAX_WORD];      // The word to guess
     char guess[MAX_WORD];     // The current guess (for example '-o-d')
@@ -33,9 +61,74 @@ struct game_state {
 
     struct client *head;
     struct client *has_next_turn;
+    struct client *spectators;  // Watch the game but never take a turn
+
+    int id;                   // Room number, for the logs
+    int slot;                 // Index in the lobby's list of rooms
+    int seated;               // People playing; bots do not take up seats
+    int reserved;             // Seats held for players from a checkpoint
+    int queue_index;          // Position in the lobby's queue, or -1
+    long waiting_since;       // When a seat in the room last came free
+    int departed;             // Players removed in this pass
+    struct timer turn_clock;  // Runs out if the player with the turn stalls
+    struct client *clock_holder;  // Whose turn turn_clock is timing
 };
 
+/* The game engine applies the rules to a game_state and says what happened
+ * as events, without reading, writing or picking words itself. wordsrv.c
+ * turns the events into messages for the players; wordsim.c just counts
+ * them.
+ */
+#define GAME_JOINED 0     // player sat down
+#define GAME_LEFT 1       // player left
+#define GAME_REFUSED 2    // player's line was not a guess; detail says why
+#define GAME_GUESSED 3    // player guessed letter; detail is 1 if it is in
+                          // the word
+#define GAME_TURN 4       // player has the turn
+#define GAME_WON 5        // player completed the word; the game is over
+#define GAME_LOST 6       // the guesses ran out; the game is over
+
+// Why a line was refused.
+#define REFUSED_NOT_TURN 0
+#define REFUSED_EMPTY 1
+#define REFUSED_LENGTH 2
+#define REFUSED_CASE 3
+#define REFUSED_REPEAT 4
+
+struct game_event {
+    int type;
+    int detail;
+    char letter;
+    struct client *player;
+};
+
+#define MAX_GAME_EVENTS 4     // No engine call adds more than two
+
+/* The events of one or more engine calls, in order. The caller empties it
+ * by setting n to 0.
+ */
+struct game_events {
+    int n;
+    struct game_event ev[MAX_GAME_EVENTS];
+};
+
+void game_start(struct game_state *game, const char *word);
+void game_join(struct game_state *game, struct client *p,
+               struct game_events *ev);
+void game_leave(struct game_state *game, struct client *p,
+                struct game_events *ev);
+void game_guess(struct game_state *game, struct client *p, const char *line,
+                struct game_events *ev);
+void game_skip(struct game_state *game, int costs_guess,
+               struct game_events *ev);
+void game_advance(struct game_state *game, struct game_events *ev);
+void game_turn(struct game_state *game, struct game_events *ev);
+int game_over(struct game_state *game);
+int count_players(struct game_state *game);
+struct client *player_before(struct game_state *game, struct client *p);
 
 void init_game(struct game_state *game, char *dict_name);
 int get_file_length(char *filename);
 char *status_message(char *msg, struct game_state *game);
+
+#endif
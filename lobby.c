@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lobby.h"
+#include "ratelimit.h"
+#include "mem.h"
+
+#define LOBBY_INITIAL_CAP 16
+
+struct lobby lobby = {NULL, 0, 0, NULL, 0, 0, ROOM_SEATS, 1, {NULL, 0},
+                      NULL, 0, 0, 0};
+
+/*
+ * Make room for at least n pointers in the array *items of *cap.
+ */
+void grow_array(void ***items, int *cap, int n) {
+    if (n <= *cap) {
+        return;
+    }
+    int new_cap = *cap > 0 ? *cap * 2 : LOBBY_INITIAL_CAP;
+    while (new_cap < n) {
+        new_cap *= 2;
+    }
+    *items = mem_realloc(MEM_ROOMS, *items, new_cap * sizeof(void *));
+    if (*items == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    *cap = new_cap;
+}
+
+
+/*
+ * Return 1 if a player should be seated in room a before room b.
+ */
+int room_before(struct game_state *a, struct game_state *b) {
+    int a_taken = a->seated + a->reserved;
+    int b_taken = b->seated + b->reserved;
+    if (a_taken != b_taken) {
+        return a_taken > b_taken;
+    }
+    return a->waiting_since < b->waiting_since;
+}
+
+
+/*
+ * Put room at position i of the queue.
+ */
+void queue_set(struct lobby *l, int i, struct game_state *room) {
+    l->queue[i] = room;
+    room->queue_index = i;
+}
+
+
+/*
+ * Move the room at position i of the queue up past every room it should
+ * come before.
+ */
+void sift_up(struct lobby *l, int i) {
+    struct game_state *room = l->queue[i];
+    while (i > 0 && room_before(room, l->queue[(i - 1) / 2])) {
+        queue_set(l, i, l->queue[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    queue_set(l, i, room);
+}
+
+
+/*
+ * Move the room at position i of the queue down past every room that
+ * should come before it.
+ */
+void sift_down(struct lobby *l, int i) {
+    struct game_state *room = l->queue[i];
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= l->queued) {
+            break;
+        }
+        if (child + 1 < l->queued &&
+            room_before(l->queue[child + 1], l->queue[child])) {
+            child++;
+        }
+        if (!room_before(l->queue[child], room)) {
+            break;
+        }
+        queue_set(l, i, l->queue[child]);
+        i = child;
+    }
+    queue_set(l, i, room);
+}
+
+
+/*
+ * Take room out of the queue.
+ */
+void dequeue_room(struct lobby *l, struct game_state *room) {
+    int i = room->queue_index;
+    room->queue_index = -1;
+    if (--l->queued == i) {
+        return;
+    }
+    // The last room fills the gap and then finds its place from there.
+    struct game_state *moved = l->queue[l->queued];
+    queue_set(l, i, moved);
+    sift_up(l, i);
+    sift_down(l, moved->queue_index);
+}
+
+
+/*
+ * Add room, which has just been opened, to the lobby.
+ */
+void lobby_add_room(struct lobby *l, struct game_state *room) {
+    grow_array((void ***)&l->rooms, &l->rooms_cap, l->nrooms + 1);
+    room->slot = l->nrooms;
+    l->rooms[l->nrooms++] = room;
+    room->id = l->next_id++;
+    room->queue_index = -1;
+    lobby_update(l, room);
+}
+
+
+/*
+ * Remove room, which is about to be retired, from the lobby.
+ */
+void lobby_remove_room(struct lobby *l, struct game_state *room) {
+    if (room->queue_index != -1) {
+        dequeue_room(l, room);
+    }
+    struct game_state *last = l->rooms[--l->nrooms];
+    l->rooms[room->slot] = last;
+    last->slot = room->slot;
+}
+
+
+/*
+ * Move room to where it belongs in the queue now that its number of seated
+ * players or held seats has changed, adding it if a seat has come free and
+ * dropping it if it is full. O(log n) in the number of rooms with free
+ * seats.
+ */
+void lobby_update(struct lobby *l, struct game_state *room) {
+    if (room->seated + room->reserved >= l->seats) {
+        if (room->queue_index != -1) {
+            dequeue_room(l, room);
+        }
+        return;
+    }
+    if (room->queue_index == -1) {
+        grow_array((void ***)&l->queue, &l->queue_cap, l->queued + 1);
+        room->waiting_since = ratelimit_clock;
+        queue_set(l, l->queued++, room);
+        sift_up(l, room->queue_index);
+        return;
+    }
+    sift_up(l, room->queue_index);
+    sift_down(l, room->queue_index);
+}
+
+
+/*
+ * Return the room the next player should be seated in, or NULL if every
+ * room is full.
+ */
+struct game_state *lobby_best_room(struct lobby *l) {
+    return l->queued > 0 ? l->queue[0] : NULL;
+}
+
+
+/*
+ * Queue p, who has just chosen a name, to be seated with the next batch.
+ */
+void lobby_wait(struct lobby *l, struct client *p) {
+    grow_array((void ***)&l->waiting, &l->waiting_cap, l->nwaiting + 1);
+    l->waiting[l->nwaiting++] = p;
+}
@@ -0,0 +1,40 @@
+#ifndef _LOBBY_H_
+#define _LOBBY_H_
+
+#include "gameplay.h"
+
+#define ROOM_SEATS 8          // Players per room unless -R says otherwise
+#define MAX_ROOM_PLAYERS 4096 // The most -R allows, and a snapshot may hold
+
+/* Every open room, and the rooms that still have a free seat in a binary
+ * heap. The room at the top of the heap is the one a player should join:
+ * the fullest, and of equally full rooms the one that has been waiting
+ * longest for another player. Filling the fullest rooms first gets games
+ * going quickly when many players arrive at once, and leaves few rooms
+ * half empty when only a few do.
+ */
+struct lobby {
+    struct game_state **rooms;
+    int nrooms;
+    int rooms_cap;
+    struct game_state **queue;    // Rooms with a free seat, as a heap
+    int queued;
+    int queue_cap;
+    int seats;                    // Players a room holds
+    int next_id;
+    struct dictionary dict;       // Shared by every room
+    struct client **waiting;      // Named players waiting for a seat
+    int nwaiting;
+    int waiting_cap;
+    int players;                  // Seated in any room; bots are not
+};
+
+extern struct lobby lobby;
+
+void lobby_add_room(struct lobby *l, struct game_state *room);
+void lobby_remove_room(struct lobby *l, struct game_state *room);
+void lobby_update(struct lobby *l, struct game_state *room);
+struct game_state *lobby_best_room(struct lobby *l);
+void lobby_wait(struct lobby *l, struct client *p);
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mem.h"
+
+/* Placed in front of every allocation, so that mem_free knows what to
+ * uncharge. It keeps the 16-byte alignment malloc gives.
+ */
+struct mem_header {
+    size_t size;
+    int sub;
+} __attribute__((aligned(16)));
+
+struct mem_stats mem_stats[NUM_SUBSYSTEMS];
+
+char *subsystem_names[NUM_SUBSYSTEMS] = {"clients", "buffers", "dictionary",
+                                         "rooms", "server"};
+
+/*
+ * Charge an allocation of size bytes to subsystem sub.
+ */
+void mem_charge(int sub, size_t size) {
+    struct mem_stats *s = &mem_stats[sub];
+    s->bytes += size;
+    s->blocks++;
+    s->allocs++;
+    if (s->bytes > s->peak) {
+        s->peak = s->bytes;
+    }
+}
+
+
+/*
+ * Uncharge the allocation with header h.
+ */
+void mem_uncharge(struct mem_header *h) {
+    mem_stats[h->sub].bytes -= h->size;
+    mem_stats[h->sub].blocks--;
+}
+
+
+/*
+ * Allocate size bytes for subsystem sub, like malloc.
+ */
+void *mem_malloc(int sub, size_t size) {
+    struct mem_header *h = malloc(sizeof(struct mem_header) + size);
+    if (h == NULL) {
+        return NULL;
+    }
+    h->size = size;
+    h->sub = sub;
+    mem_charge(sub, size);
+    return h + 1;
+}
+
+
+/*
+ * Allocate n zeroed elements of size bytes for subsystem sub, like calloc.
+ */
+void *mem_calloc(int sub, size_t n, size_t size) {
+    void *ptr = mem_malloc(sub, n * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, n * size);
+    }
+    return ptr;
+}
+
+
+/*
+ * Resize ptr (allocated for subsystem sub, or NULL) to size bytes, like
+ * realloc. On failure ptr is left as it was.
+ */
+void *mem_realloc(int sub, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return mem_malloc(sub, size);
+    }
+    struct mem_header *old = (struct mem_header *)ptr - 1;
+    size_t old_size = old->size;
+    struct mem_header *h = realloc(old, sizeof(struct mem_header) + size);
+    if (h == NULL) {
+        return NULL;
+    }
+    mem_stats[h->sub].bytes += size - old_size;
+    if (mem_stats[h->sub].bytes > mem_stats[h->sub].peak) {
+        mem_stats[h->sub].peak = mem_stats[h->sub].bytes;
+    }
+    h->size = size;
+    return h + 1;
+}
+
+
+/*
+ * Free ptr, which came from one of the functions above, or do nothing if
+ * it is NULL.
+ */
+void mem_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    struct mem_header *h = (struct mem_header *)ptr - 1;
+    mem_uncharge(h);
+    free(h);
+}
+
+
+/*
+ * Print what each subsystem has allocated, and the resident set size of
+ * the process as the kernel sees it.
+ */
+void mem_dump(FILE *fp) {
+    long bytes = 0, blocks = 0;
+    fprintf(fp, "%-10s %12s %10s %12s %12s\n", "memory", "bytes", "blocks",
+            "allocs", "peak bytes");
+    for (int i = 0; i < NUM_SUBSYSTEMS; i++) {
+        struct mem_stats *s = &mem_stats[i];
+        fprintf(fp, "%-10s %12ld %10ld %12ld %12ld\n", subsystem_names[i],
+                s->bytes, s->blocks, s->allocs, s->peak);
+        bytes += s->bytes;
+        blocks += s->blocks;
+    }
+    fprintf(fp, "%-10s %12ld %10ld\n", "total", bytes, blocks);
+
+    long size, resident;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%ld %ld", &size, &resident) == 2) {
+            fprintf(fp, "RSS %ld kB\n",
+                    resident * sysconf(_SC_PAGESIZE) / 1024);
+        }
+        fclose(statm);
+    }
+    fflush(fp);
+}
@@ -0,0 +1,32 @@
+#ifndef _MEM_H_
+#define _MEM_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* What an allocation is for. Every allocation the server makes is charged
+ * to one of these, so that growth can be pinned on a subsystem.
+ */
+#define MEM_CLIENTS 0     // struct client, per-connection I/O state and names
+#define MEM_BUFFERS 1     // Messages, output queues and I/O buffers
+#define MEM_DICTIONARY 2  // The solver's index of the dictionary
+#define MEM_ROOMS 3       // Rooms, the lobby and held seats
+#define MEM_SERVER 4      // Everything else: rate limits, tracing, ...
+#define NUM_SUBSYSTEMS 5
+
+struct mem_stats {
+    long bytes;     // Bytes in use
+    long blocks;    // Allocations in use
+    long allocs;    // Allocations ever made
+    long peak;      // The most bytes ever in use at once
+};
+
+extern struct mem_stats mem_stats[NUM_SUBSYSTEMS];
+
+void *mem_malloc(int sub, size_t size);
+void *mem_calloc(int sub, size_t n, size_t size);
+void *mem_realloc(int sub, void *ptr, size_t size);
+void mem_free(void *ptr);
+void mem_dump(FILE *fp);
+
+#endif
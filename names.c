@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+#include "mem.h"
+
+#define NAMES_INITIAL_CAP 64
+
+struct name_registry registry = {NULL, 0, 0, 0};
+
+/*
+ * Return the FNV-1a hash of name.
+ */
+unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;
+    for (; *name != '\0'; name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/*
+ * Return the slot holding name, or NULL if name is not claimed.
+ */
+struct name_slot *find_slot(const char *name) {
+    if (registry.cap == 0) {
+        return NULL;
+    }
+    unsigned int mask = registry.cap - 1;
+    for (unsigned int i = hash_name(name) & mask; ; i = (i + 1) & mask) {
+        struct name_slot *slot = &registry.slots[i];
+        if (slot->name[0] == '\0') {
+            return NULL;
+        }
+        if (slot->owner != NULL && strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+    }
+}
+
+
+/*
+ * Rebuild the table with room for cap slots, dropping the tombstones.
+ */
+void resize_registry(int cap) {
+    struct name_slot *old = registry.slots;
+    int old_cap = registry.cap;
+
+    registry.slots = mem_calloc(MEM_CLIENTS, cap, sizeof(struct name_slot));
+    if (registry.slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    registry.cap = cap;
+    registry.used = registry.count;
+
+    unsigned int mask = cap - 1;
+    for (int j = 0; j < old_cap; j++) {
+        if (old[j].owner == NULL) {
+            continue;
+        }
+        unsigned int i = hash_name(old[j].name) & mask;
+        while (registry.slots[i].name[0] != '\0') {
+            i = (i + 1) & mask;
+        }
+        registry.slots[i] = old[j];
+    }
+    mem_free(old);
+}
+
+
+/*
+ * Claim name for owner.
+ * Return 0 on success and -1 if someone else already has the name.
+ */
+int names_claim(const char *name, struct client *owner) {
+    if (find_slot(name) != NULL) {
+        return -1;
+    }
+
+    // Keep the table at most 3/4 full, counting tombstones, so that probe
+    // sequences stay short.
+    if ((registry.used + 1) * 4 > registry.cap * 3) {
+        int cap = registry.cap ? registry.cap : NAMES_INITIAL_CAP;
+        while ((registry.count + 1) * 2 > cap) {
+            cap *= 2;
+        }
+        resize_registry(cap);
+    }
+
+    // Reuse the first tombstone on the probe sequence, if there is one.
+    unsigned int mask = registry.cap - 1;
+    unsigned int i = hash_name(name) & mask;
+    while (registry.slots[i].owner != NULL) {
+        i = (i + 1) & mask;
+    }
+    struct name_slot *slot = &registry.slots[i];
+    if (slot->name[0] == '\0') {
+        registry.used++;
+    }
+    strncpy(slot->name, name, MAX_NAME);
+    slot->name[MAX_NAME - 1] = '\0';
+    slot->owner = owner;
+    registry.count++;
+    return 0;
+}
+
+
+/*
+ * Release name so that another player may claim it.
+ */
+void names_release(const char *name) {
+    struct name_slot *slot = find_slot(name);
+    if (slot == NULL) {
+        fprintf(stderr, "Releasing name %s, but nobody has it\n", name);
+        return;
+    }
+    // Leave the name in place as a tombstone so that later probe
+    // sequences through this slot are not cut short.
+    slot->owner = NULL;
+    registry.count--;
+}
+
+
+/*
+ * Return the client that has claimed name, or NULL if nobody has.
+ */
+struct client *names_lookup(const char *name) {
+    struct name_slot *slot = find_slot(name);
+    return slot ? slot->owner : NULL;
+}
+
+
+/*
+ * Return the number of names currently claimed.
+ */
+int names_count() {
+    return registry.count;
+}
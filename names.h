@@ -0,0 +1,32 @@
+#ifndef _NAMES_H_
+#define _NAMES_H_
+
+#include "gameplay.h"
+
+/* One slot of the name registry. A slot is empty when owner is NULL and
+ * name is empty, and a tombstone (a name that was released) when owner is
+ * NULL but name is not.
+ */
+struct name_slot {
+    char name[MAX_NAME];
+    struct client *owner;
+};
+
+/* Every name in use on the server, in an open-addressing hash table with
+ * linear probing. Names are claimed when a player's name is accepted and
+ * released when they disconnect, so claiming a name is also the uniqueness
+ * check.
+ */
+struct name_registry {
+    struct name_slot *slots;
+    int cap;         // A power of 2
+    int count;       // Names currently claimed
+    int used;        // Slots that are not empty (claimed or tombstones)
+};
+
+int names_claim(const char *name, struct client *owner);
+void names_release(const char *name);
+struct client *names_lookup(const char *name);
+int names_count();
+
+#endif
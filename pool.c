@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "mem.h"
+
+
+/*
+ * Return an object from pool, allocating a new slab if none is free.
+ * The object's contents are undefined.
+ */
+void *pool_get(struct pool *pool) {
+    if (pool->free == NULL) {
+        char *slab = mem_malloc(pool->sub, (size_t)pool->size * pool->per_slab);
+        if (slab == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        // Thread the new objects onto the free list in address order.
+        for (int i = pool->per_slab - 1; i >= 0; i--) {
+            void **obj = (void **)(slab + (size_t)i * pool->size);
+            *obj = pool->free;
+            pool->free = obj;
+        }
+        pool->slabs++;
+    }
+    void **obj = pool->free;
+    pool->free = *obj;
+    pool->in_use++;
+    return obj;
+}
+
+
+/*
+ * Give obj, which came from pool, back to it.
+ */
+void pool_put(struct pool *pool, void *obj) {
+    *(void **)obj = pool->free;
+    pool->free = obj;
+    pool->in_use--;
+}
+
+
+/*
+ * Print how many of pool's objects are in use and how many its slabs hold.
+ */
+void pool_dump(FILE *fp, char *name, struct pool *pool) {
+    fprintf(fp, "%-10s pool %8ld in use of %8ld (%d bytes each)\n", name,
+            pool->in_use, pool->slabs * pool->per_slab, pool->size);
+}
@@ -0,0 +1,31 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stdio.h>
+
+/* Objects of one size, carved out of slabs of per_slab objects at a time.
+ * Objects that are given back go on a free list and are handed out again
+ * before a new slab is allocated, so objects in use stay packed together
+ * and cost no allocation header each. Slabs are kept for the life of the
+ * server. POOL_INIT rounds size up to a multiple of 16, so that every object
+ * in a slab is aligned as malloc would align it; size must be at least a
+ * pointer.
+ */
+struct pool {
+    int size;
+    int per_slab;
+    int sub;          // The mem subsystem the slabs are charged to
+    void *free;       // Free objects, each starting with the next one
+    long in_use;
+    long slabs;
+};
+
+#define POOL_ALIGN(size) (((size) + 15) & ~15)
+#define POOL_INIT(size, per_slab, sub) \
+    {POOL_ALIGN(size), per_slab, sub, NULL, 0, 0}
+
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *obj);
+void pool_dump(FILE *fp, char *name, struct pool *pool);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ratelimit.h"
+#include "mem.h"
+
+#define IP_TABLE_INITIAL_CAP 64
+
+long ratelimit_clock = 0;
+int ratelimit_enabled = 1;
+struct rate_stats rate_stats = {0, 0};
+struct ip_table ip_table = {NULL, 0, 0};
+
+/*
+ * Set ratelimit_clock to the current time.
+ */
+void ratelimit_tick() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ratelimit_clock = now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+
+/*
+ * Start b off full.
+ */
+void bucket_init(struct token_bucket *b, int burst) {
+    b->tokens = burst * TOKEN;
+    b->last = ratelimit_clock;
+}
+
+
+/*
+ * Refill b for the time since it was last used.
+ */
+void bucket_refill(struct token_bucket *b, int rate, int burst) {
+    long elapsed = ratelimit_clock - b->last;
+    if (elapsed > 0) {
+        // Microseconds times tokens per second is millionths of a token.
+        b->tokens += elapsed * rate;
+        if (b->tokens > burst * TOKEN) {
+            b->tokens = burst * TOKEN;
+        }
+    }
+    b->last = ratelimit_clock;
+}
+
+
+/*
+ * Take a token from b.
+ * Return 1 if there was one to take and 0 if the action is over the limit.
+ */
+int bucket_take(struct token_bucket *b, int rate, int burst) {
+    bucket_refill(b, rate, burst);
+    if (b->tokens < TOKEN) {
+        return 0;
+    }
+    b->tokens -= TOKEN;
+    return 1;
+}
+
+
+/*
+ * Return the home slot of addr in a table with cap slots.
+ */
+unsigned int hash_addr(in_addr_t addr, int cap) {
+    return (addr * 2654435769u) & (cap - 1);
+}
+
+
+/*
+ * Return 1 if e could be dropped without changing any decision: nothing is
+ * open from its address and its bucket has refilled.
+ */
+int idle_entry(struct ip_entry *e) {
+    if (e->conns > 0) {
+        return 0;
+    }
+    bucket_refill(&e->connects, CONNECT_RATE, CONNECT_BURST);
+    return e->connects.tokens == CONNECT_BURST * TOKEN;
+}
+
+
+/*
+ * Rebuild the table without its idle entries, doubling it if it would
+ * still be more than half full.
+ */
+void rebuild_ip_table() {
+    struct ip_entry *old = ip_table.slots;
+    int old_cap = ip_table.cap;
+    int kept = 0;
+
+    for (int j = 0; j < old_cap; j++) {
+        if (old[j].addr != 0 && !idle_entry(&old[j])) {
+            kept++;
+        }
+    }
+    int cap = old_cap > 0 ? old_cap : IP_TABLE_INITIAL_CAP;
+    while (kept * 2 > cap) {
+        cap *= 2;
+    }
+
+    ip_table.slots = mem_calloc(MEM_SERVER, cap, sizeof(struct ip_entry));
+    if (ip_table.slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    ip_table.cap = cap;
+    ip_table.count = kept;
+    for (int j = 0; j < old_cap; j++) {
+        if (old[j].addr == 0 || idle_entry(&old[j])) {
+            continue;
+        }
+        unsigned int i = hash_addr(old[j].addr, cap);
+        while (ip_table.slots[i].addr != 0) {
+            i = (i + 1) & (cap - 1);
+        }
+        ip_table.slots[i] = old[j];
+    }
+    mem_free(old);
+}
+
+
+/*
+ * Return the entry for addr, adding it if create is set.
+ * Return NULL if there is none and create is not set.
+ */
+struct ip_entry *find_entry(in_addr_t addr, int create) {
+    if (create && (ip_table.count + 1) * 4 > ip_table.cap * 3) {
+        rebuild_ip_table();
+    }
+    if (ip_table.cap == 0) {
+        return NULL;
+    }
+    unsigned int mask = ip_table.cap - 1;
+    for (unsigned int i = hash_addr(addr, ip_table.cap); ; i = (i + 1) & mask) {
+        struct ip_entry *e = &ip_table.slots[i];
+        if (e->addr == addr) {
+            return e;
+        }
+        if (e->addr == 0) {
+            if (!create) {
+                return NULL;
+            }
+            e->addr = addr;
+            e->conns = 0;
+            bucket_init(&e->connects, CONNECT_BURST);
+            ip_table.count++;
+            return e;
+        }
+    }
+}
+
+
+/*
+ * Decide whether to admit a new connection from addr, counting it if so.
+ * Return 0 if it is admitted and -1 if addr is over its limits.
+ */
+int ratelimit_connect(struct in_addr addr) {
+    struct ip_entry *e = find_entry(addr.s_addr, 1);
+    if (ratelimit_enabled &&
+        (e->conns >= MAX_CONNS_PER_IP ||
+         !bucket_take(&e->connects, CONNECT_RATE, CONNECT_BURST))) {
+        rate_stats.refused_connections++;
+        return -1;
+    }
+    e->conns++;
+    return 0;
+}
+
+
+/*
+ * Count a connection from addr that was admitted some other way, such as
+ * one handed over by the server this one replaced.
+ */
+void ratelimit_track(struct in_addr addr) {
+    find_entry(addr.s_addr, 1)->conns++;
+}
+
+
+/*
+ * Stop counting a connection from addr that has closed.
+ */
+void ratelimit_release(struct in_addr addr) {
+    struct ip_entry *e = find_entry(addr.s_addr, 0);
+    if (e != NULL && e->conns > 0) {
+        e->conns--;
+    }
+}
+
+
+/*
+ * Take a token for one line of input from b, a connection's bucket.
+ * Return 1 if the line should be handled and 0 if it should be dropped.
+ */
+int ratelimit_line(struct token_bucket *b) {
+    if (!ratelimit_enabled || bucket_take(b, LINE_RATE, LINE_BURST)) {
+        return 1;
+    }
+    rate_stats.dropped_lines++;
+    return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <netinet/in.h>
+
+#define CONNECT_RATE 5        // New connections per second from one address
+#define CONNECT_BURST 20      // New connections allowed at once
+#define MAX_CONNS_PER_IP 32   // Connections open at once from one address
+#define LINE_RATE 10          // Lines per second from one connection
+#define LINE_BURST 20         // Lines allowed at once
+#define TOKEN 1000000L        // A whole token, in the units of tokens below
+
+/* A token bucket: it holds up to burst tokens and refills at rate tokens
+ * per second; an action is allowed if it can take a whole token.
+ */
+struct token_bucket {
+    long tokens;  // In millionths of a token
+    long last;    // ratelimit_clock when tokens was last brought up to date
+};
+
+/* Rate limiting state for one remote address. A slot is empty when addr
+ * is 0, which no peer can have.
+ */
+struct ip_entry {
+    in_addr_t addr;
+    int conns;                      // Connections open from addr
+    struct token_bucket connects;   // New connections from addr
+};
+
+/* Every address with a connection open or a bucket that has not refilled
+ * yet, in an open-addressing hash table with linear probing.
+ */
+struct ip_table {
+    struct ip_entry *slots;
+    int cap;       // A power of 2
+    int count;     // Slots in use
+};
+
+/* What the limits have turned away. */
+struct rate_stats {
+    long refused_connections;
+    long dropped_lines;
+};
+
+/* Microseconds on a clock that only moves forward. The event loop sets it
+ * once per pass; a replay sets it from the recording.
+ */
+extern long ratelimit_clock;
+/* 0 when the server was started with -L; nothing is limited then. */
+extern int ratelimit_enabled;
+extern struct rate_stats rate_stats;
+
+void ratelimit_tick();
+void bucket_init(struct token_bucket *b, int burst);
+int bucket_take(struct token_bucket *b, int rate, int burst);
+int ratelimit_connect(struct in_addr addr);
+void ratelimit_track(struct in_addr addr);
+void ratelimit_release(struct in_addr addr);
+int ratelimit_line(struct token_bucket *b);
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "record.h"
+
+/* A recording is a text file. The first line is
+ *     wordsrv-recording <seed> <dictionary length>
+ * and every line after it is one event:
+ *     <usec> connect <fd>
+ *     <usec> input <fd> <data as hex>
+ *     <usec> close <fd>
+ * Input is recorded exactly as it was read from the socket, before it is
+ * split into lines, so a replay exercises the same buffering code.
+ */
+
+FILE *recording = NULL;
+struct timespec record_start;
+
+/*
+ * Return the number of microseconds since the recording started.
+ */
+long record_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - record_start.tv_sec) * 1000000L
+           + (now.tv_nsec - record_start.tv_nsec) / 1000;
+}
+
+
+/*
+ * Start recording to filename. seed is the value passed to srandom, and
+ * dict_size the number of words in the dictionary; a replay needs both to
+ * pick the same words.
+ */
+void record_open(char *filename, unsigned int seed, int dict_size) {
+    recording = fopen(filename, "w");
+    if (recording == NULL) {
+        perror("Opening recording");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &record_start);
+    fprintf(recording, "wordsrv-recording %u %d\n", seed, dict_size);
+}
+
+
+/*
+ * Record that a client connected on fd.
+ */
+void record_connect(int fd) {
+    fprintf(recording, "%ld connect %d\n", record_time(), fd);
+}
+
+
+/*
+ * Record the len bytes in buf that were read from fd, as hex, in events of
+ * at most MAX_EVENT_DATA bytes.
+ */
+void record_input(int fd, const char *buf, int len) {
+    long usec = record_time();
+    // Split reads that are too big to replay in one event.
+    for (int i = 0; i < len; i++) {
+        if (i % MAX_EVENT_DATA == 0) {
+            if (i > 0) {
+                fputc('\n', recording);
+            }
+            fprintf(recording, "%ld input %d ", usec, fd);
+        }
+        fprintf(recording, "%02x", (unsigned char)buf[i]);
+    }
+    fputc('\n', recording);
+}
+
+
+/*
+ * Record that the client on fd hung up or was disconnected.
+ */
+void record_close(int fd) {
+    fprintf(recording, "%ld close %d\n", record_time(), fd);
+}
+
+
+/*
+ * Push buffered events out to the file. Called once per pass through the
+ * event loop so that a killed server loses at most one pass.
+ */
+void record_flush() {
+    if (fflush(recording) == EOF) {
+        perror("Writing recording");
+    }
+}
+
+
+/*
+ * Open the recording in filename for replay and read its header.
+ */
+FILE *replay_open(char *filename, unsigned int *seed, int *dict_size) {
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        perror("Opening recording");
+        exit(1);
+    }
+    if (fscanf(fp, "wordsrv-recording %u %d\n", seed, dict_size) != 2) {
+        fprintf(stderr, "%s is not a wordsrv recording\n", filename);
+        exit(1);
+    }
+    return fp;
+}
+
+
+/*
+ * Read the next event from fp into e.
+ * Return 1 on success and 0 at the end of the recording.
+ */
+int replay_next(FILE *fp, struct event *e) {
+    char type[16];
+    if (fscanf(fp, "%ld %15s %d", &e->usec, type, &e->fd) != 3) {
+        return 0;
+    }
+    e->len = 0;
+    if (strcmp(type, "connect") == 0) {
+        e->type = EVENT_CONNECT;
+    } else if (strcmp(type, "close") == 0) {
+        e->type = EVENT_CLOSE;
+    } else if (strcmp(type, "input") == 0) {
+        e->type = EVENT_INPUT;
+        // Two hex digits per byte; the width below must match.
+        static char hex[2 * MAX_EVENT_DATA + 1];
+        if (fscanf(fp, "%8192s", hex) != 1) {
+            return 0;
+        }
+        unsigned int byte;
+        while (hex[2 * e->len] != '\0'
+               && sscanf(hex + 2 * e->len, "%2x", &byte) == 1) {
+            e->data[e->len++] = byte;
+        }
+    } else {
+        fprintf(stderr, "Unknown event %s in recording\n", type);
+        exit(1);
+    }
+    return 1;
+}
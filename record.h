@@ -0,0 +1,35 @@
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdio.h>
+
+/* Kinds of event in a recording. */
+#define EVENT_CONNECT 0
+#define EVENT_INPUT 1
+#define EVENT_CLOSE 2
+
+/* The longest input chunk one event may hold. */
+#define MAX_EVENT_DATA 4096
+
+/* One event read back from a recording. */
+struct event {
+    long usec;     // Time since the recording started
+    int type;
+    int fd;        // Socket descriptor of the client in the recorded run
+    int len;       // Bytes of data (EVENT_INPUT only)
+    char data[MAX_EVENT_DATA];
+};
+
+/* Set when the server is recording; NULL otherwise. */
+extern FILE *recording;
+
+void record_open(char *filename, unsigned int seed, int dict_size);
+void record_connect(int fd);
+void record_input(int fd, const char *buf, int len);
+void record_close(int fd);
+void record_flush();
+
+FILE *replay_open(char *filename, unsigned int *seed, int *dict_size);
+int replay_next(FILE *fp, struct event *e);
+
+#endif
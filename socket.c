@@ -2,18 +2,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <sys/socket.h>
+#include <sys/uio.h>       /* writev */
+#include <limits.h>        /* IOV_MAX */
+#include <netinet/tcp.h>   /* TCP_NODELAY, TCP_CORK */
 
 #include "socket.h"
+#include "mem.h"
+
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
 
 /*
  * Initialize a server address associated with the given port.
  */
-struct sockaddr_in *init_server_addr(int port) {
-    struct sockaddr_in *addr = malloc(sizeof(struct sockaddr_in));
-
+void init_server_addr(struct sockaddr_in *addr, int port) {
     // Allow sockets across machines.
     addr->sin_family = PF_INET;
 
@@ -25,8 +33,6 @@ struct sockaddr_in *init_server_addr(int port) {
 
     // Listen on all network interfaces.
     addr->sin_addr.s_addr = INADDR_ANY;
-
-    return addr;
 }
 
 
@@ -69,11 +75,12 @@ int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
 
 
 /*
- * Wait for and accept a new connection.
- * Terminate with exit code 1 if the accept call failed, otherwise return
- * the client's socket descriptor.
+ * Wait for and accept a new connection, storing the peer's address in addr.
+ * Return the client's socket descriptor, or -1 if the accept call failed
+ * (for example because the server is out of descriptors), in which case
+ * the server carries on.
  */
-int accept_connection(int listenfd) {
+int accept_connection(int listenfd, struct in_addr *addr) {
     struct sockaddr_in peer;
     unsigned int peer_len = sizeof(peer);
     peer.sin_family = PF_INET;
@@ -82,13 +89,207 @@ int accept_connection(int listenfd) {
     int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
     if (client_socket < 0) {
         perror("accept");
-        exit(1);
+        return -1;
     } else {
         printf("New connection accepted from %s:%d\n",
             inet_ntoa(peer.sin_addr),
             ntohs(peer.sin_port));
+        tune_client_socket(client_socket);
+        *addr = peer.sin_addr;
         return client_socket;
     }
 }
 
 
+/*
+ * Set the options we want on every client socket, however it was accepted.
+ */
+void tune_client_socket(int fd) {
+    // Output is coalesced per client and flushed once per pass through
+    // the event loop, so there is nothing for Nagle to batch; disable it
+    // so each flush goes out immediately.
+    int on = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+    }
+    // Output the socket buffer cannot take waits in the client's queue
+    // instead, so that a client that stops reading cannot stall the server.
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+    }
+}
+
+
+/*
+ * Create a message holding a copy of text with a single reference owned
+ * by the caller.
+ */
+struct message *new_message(const char *text) {
+    int len = strlen(text);
+    struct message *m = mem_malloc(MEM_BUFFERS,
+                                   sizeof(struct message) + len + 1);
+    if (m == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    m->refs = 1;
+    m->len = len;
+    memcpy(m->text, text, len + 1);
+    return m;
+}
+
+
+/*
+ * Drop one reference to m, freeing it when no references remain.
+ */
+void release_message(struct message *m) {
+    if (--m->refs == 0) {
+        mem_free(m);
+    }
+}
+
+
+/*
+ * Append m to the queue q. The queue takes its own reference to m.
+ */
+void enqueue_message(struct outqueue *q, struct message *m) {
+    if (q->count == q->cap) {
+        int cap = q->cap < 8 ? 8 : q->cap * 2;
+        struct message **msgs;
+        if (q->msgs == q->inline_msgs) {
+            msgs = mem_malloc(MEM_BUFFERS, cap * sizeof(*msgs));
+            if (msgs != NULL) {
+                memcpy(msgs, q->inline_msgs, q->count * sizeof(*msgs));
+            }
+        }
+        else {
+            msgs = mem_realloc(MEM_BUFFERS, q->msgs, cap * sizeof(*msgs));
+        }
+        if (msgs == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        q->msgs = msgs;
+        q->cap = cap;
+    }
+    m->refs++;
+    q->msgs[q->count++] = m;
+}
+
+
+/*
+ * Write as much of q to fd as the socket takes without blocking, with as
+ * few writev calls as possible, and drop what was written from q. Whatever
+ * did not fit stays queued, with q->sent noting how far into the first
+ * message the socket got, to be written once fd is writable again.
+ * Return 0 if q is now empty, 1 if output is still waiting in it and -1 if
+ * the write failed, in which case q is emptied.
+ */
+int flush_queue(int fd, struct outqueue *q) {
+    struct iovec iov[IOV_MAX];
+    int status = 0;
+    int done = 0;    // Messages written in full
+
+    if (q->count == 0) {
+        return 0;
+    }
+
+    // A queue longer than IOV_MAX needs several writev calls; cork the
+    // socket so they still leave as full segments.
+    int corked = q->count > IOV_MAX;
+    int on = 1, off = 0;
+    if (corked) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+
+    while (done < q->count) {
+        int n = q->count - done;
+        if (n > IOV_MAX) {
+            n = IOV_MAX;
+        }
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = q->msgs[done + i]->text;
+            iov[i].iov_len = q->msgs[done + i]->len;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + q->sent;
+        iov[0].iov_len -= q->sent;
+
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            status = errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+            break;
+        }
+        // Step over what was written, picking up after a short write where
+        // the kernel left off.
+        while (done < q->count) {
+            size_t left = q->msgs[done]->len - q->sent;
+            if ((size_t)written < left) {
+                q->sent += written;
+                break;
+            }
+            written -= left;
+            q->sent = 0;
+            done++;
+        }
+    }
+
+    if (corked) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    }
+    if (status == -1) {
+        clear_queue(q);
+        return -1;
+    }
+    for (int i = 0; i < done; i++) {
+        release_message(q->msgs[i]);
+    }
+    memmove(q->msgs, q->msgs + done, (q->count - done) * sizeof(*q->msgs));
+    q->count -= done;
+    if (q->count == 0) {
+        shrink_queue(q);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Drop every message in q without writing it, and free its array, if it
+ * has one.
+ */
+void clear_queue(struct outqueue *q) {
+    for (int i = 0; i < q->count; i++) {
+        release_message(q->msgs[i]);
+    }
+    q->count = 0;
+    q->sent = 0;
+    shrink_queue(q);
+}
+
+
+/*
+ * Set q up empty, using its inline slot.
+ */
+void init_queue(struct outqueue *q) {
+    q->msgs = q->inline_msgs;
+    q->count = 0;
+    q->cap = OUTQUEUE_INLINE;
+    q->sent = 0;
+}
+
+
+/*
+ * Free the array of the empty queue q, if it has one, and go back to its
+ * inline slot.
+ */
+void shrink_queue(struct outqueue *q) {
+    if (q->msgs != q->inline_msgs) {
+        mem_free(q->msgs);
+        q->msgs = q->inline_msgs;
+        q->cap = OUTQUEUE_INLINE;
+    }
+}
@@ -3,8 +3,46 @@
 
 #include <netinet/in.h>    /* Internet domain header, for struct sockaddr_in */
 
-struct sockaddr_in *init_server_addr(int port);
+/* A pre-rendered message. A single message may be queued on many clients
+ * at once (for example by broadcast), so it is reference counted and freed
+ * when the last queue holding it has been flushed.
+ */
+struct message {
+    int refs;
+    int len;
+    char text[];
+};
+
+#define OUTQUEUE_INLINE 1  // Messages a queue holds without an array
+#define OUTQUEUE_MAX 4096  // Messages a client may fall behind by before it
+                           // is dropped
+
+/* Messages waiting to be written to one client at the end of the current
+ * pass through the event loop, and anything an earlier pass could not
+ * write because the client's socket buffer was full. msgs points at the
+ * queue's own inline slot until more messages are queued at once than fit
+ * there, and goes back to it once the queue is empty, so only a client
+ * with several messages waiting has an array.
+ */
+struct outqueue {
+    struct message **msgs;
+    int count;
+    int cap;
+    int sent;          // Bytes of msgs[0] already written
+    struct message *inline_msgs[OUTQUEUE_INLINE];
+};
+
+void init_server_addr(struct sockaddr_in *addr, int port);
 int set_up_server_socket(struct sockaddr_in *self, int num_queue);
-int accept_connection(int listenfd);
+int accept_connection(int listenfd, struct in_addr *addr);
+void tune_client_socket(int fd);
+
+struct message *new_message(const char *text);
+void release_message(struct message *m);
+void enqueue_message(struct outqueue *q, struct message *m);
+int flush_queue(int fd, struct outqueue *q);
+void clear_queue(struct outqueue *q);
+void init_queue(struct outqueue *q);
+void shrink_queue(struct outqueue *q);
 
 #endif
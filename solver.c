@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "solver.h"
+#include "mem.h"
+
+/* Letters by how common they are in English, for when no word fits. */
+#define LETTER_ORDER "etaoinshrdlcumwfgypbvkjxqz"
+
+struct solver engine;
+
+/*
+ * Return the bitset of the words in set with letter c at position i.
+ */
+uint64_t *word_set_at(struct word_set *set, int i, int c) {
+    return set->at + (i * NUM_LETTERS + c) * set->nblocks;
+}
+
+
+/*
+ * Return 1 if word is a word the solver can index, and 0 otherwise.
+ */
+int indexable(const char *word, int len) {
+    if (len == 0 || len > SOLVER_MAX_LEN) {
+        return 0;
+    }
+    for (int i = 0; i < len; i++) {
+        if (word[i] < 'a' || word[i] > 'z') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Read the dictionary dict_name into s. The file is read twice: once to
+ * count the words of each length and once to set their bits.
+ */
+void solver_init(struct solver *s, char *dict_name) {
+    char buf[MAX_MSG];
+    int next[SOLVER_MAX_LEN + 1];
+    int max_blocks = 0;
+    FILE *fp;
+
+    if ((fp = fopen(dict_name, "r")) == NULL) {
+        perror("open");
+        exit(1);
+    }
+    memset(s, 0, sizeof(*s));
+    while (fgets(buf, MAX_MSG, fp) != NULL) {
+        int len = strcspn(buf, "\r\n");
+        if (indexable(buf, len)) {
+            s->sets[len].count++;
+        }
+    }
+
+    for (int len = 1; len <= SOLVER_MAX_LEN; len++) {
+        struct word_set *set = &s->sets[len];
+        set->nblocks = (set->count + 63) / 64;
+        set->at = mem_calloc(MEM_DICTIONARY, len * NUM_LETTERS * set->nblocks,
+                             sizeof(uint64_t));
+        set->has = mem_calloc(MEM_DICTIONARY, NUM_LETTERS * set->nblocks,
+                              sizeof(uint64_t));
+        set->letters = mem_calloc(MEM_DICTIONARY, set->count,
+                                  sizeof(uint32_t));
+        if ((set->at == NULL || set->has == NULL || set->letters == NULL)
+            && set->count > 0) {
+            perror("calloc");
+            exit(1);
+        }
+        if (set->nblocks > max_blocks) {
+            max_blocks = set->nblocks;
+        }
+        next[len] = 0;
+    }
+    if (max_blocks == 0) {
+        max_blocks = 1;
+    }
+    s->scratch = mem_malloc(MEM_DICTIONARY, max_blocks * sizeof(uint64_t));
+    if (s->scratch == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    rewind(fp);
+    while (fgets(buf, MAX_MSG, fp) != NULL) {
+        int len = strcspn(buf, "\r\n");
+        if (!indexable(buf, len)) {
+            continue;
+        }
+        struct word_set *set = &s->sets[len];
+        int w = next[len]++;
+        uint64_t bit = 1ULL << (w % 64);
+        for (int i = 0; i < len; i++) {
+            int c = buf[i] - 'a';
+            word_set_at(set, i, c)[w / 64] |= bit;
+            set->has[c * set->nblocks + w / 64] |= bit;
+            set->letters[w] |= 1u << c;
+        }
+    }
+    fclose(fp);
+}
+
+
+/*
+ * Find the dictionary words that still fit guess (for example "-o-d")
+ * given the letters guessed so far, and set counts[c] to how many of them
+ * contain letter c, for every letter not yet guessed. A hidden position
+ * cannot hold a guessed letter, since guessing a letter reveals every
+ * position it is at.
+ * Return the number of words that fit.
+ */
+int solver_rank(struct solver *s, const char *guess,
+                const int *letters_guessed, int *counts) {
+    int len = strlen(guess);
+    for (int c = 0; c < NUM_LETTERS; c++) {
+        counts[c] = 0;
+    }
+    if (len == 0 || len > SOLVER_MAX_LEN || s->sets[len].count == 0) {
+        return 0;
+    }
+
+    struct word_set *set = &s->sets[len];
+    int nblocks = set->nblocks;
+    uint64_t *cand = s->scratch;
+    for (int b = 0; b < nblocks; b++) {
+        cand[b] = ~0ULL;
+    }
+    if (set->count % 64 != 0) {
+        cand[nblocks - 1] = (1ULL << (set->count % 64)) - 1;
+    }
+
+    for (int i = 0; i < len; i++) {
+        if (guess[i] != '-') {
+            if (guess[i] < 'a' || guess[i] > 'z') {
+                return 0;
+            }
+            uint64_t *at = word_set_at(set, i, guess[i] - 'a');
+            for (int b = 0; b < nblocks; b++) {
+                cand[b] &= at[b];
+            }
+            continue;
+        }
+        for (int c = 0; c < NUM_LETTERS; c++) {
+            if (letters_guessed[c]) {
+                uint64_t *at = word_set_at(set, i, c);
+                for (int b = 0; b < nblocks; b++) {
+                    cand[b] &= ~at[b];
+                }
+            }
+        }
+    }
+
+    int total = 0;
+    for (int b = 0; b < nblocks; b++) {
+        total += __builtin_popcountll(cand[b]);
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    // Once few words are left it is cheaper to visit each of them than to
+    // intersect every letter's bitset with the candidates.
+    if (total * 8 < nblocks * NUM_LETTERS) {
+        for (int b = 0; b < nblocks; b++) {
+            for (uint64_t bits = cand[b]; bits != 0; bits &= bits - 1) {
+                uint32_t mask = set->letters[b * 64 + __builtin_ctzll(bits)];
+                for (; mask != 0; mask &= mask - 1) {
+                    counts[__builtin_ctz(mask)]++;
+                }
+            }
+        }
+        for (int c = 0; c < NUM_LETTERS; c++) {
+            if (letters_guessed[c]) {
+                counts[c] = 0;
+            }
+        }
+        return total;
+    }
+    for (int c = 0; c < NUM_LETTERS; c++) {
+        if (letters_guessed[c]) {
+            continue;
+        }
+        uint64_t *has = set->has + c * nblocks;
+        int n = 0;
+        for (int b = 0; b < nblocks; b++) {
+            n += __builtin_popcountll(cand[b] & has[b]);
+        }
+        counts[c] = n;
+    }
+    return total;
+}
+
+
+/*
+ * Return the letter not yet guessed that the most words still fitting
+ * guess contain, so the one most likely to be in the word. Every guess
+ * costs one of only MAX_GUESSES, hit or miss, so a likely hit reveals the
+ * most. Return '\0' if every letter has been guessed.
+ */
+char solver_best_letter(struct solver *s, const char *guess,
+                        const int *letters_guessed) {
+    int counts[NUM_LETTERS];
+    char best = '\0';
+
+    if (solver_rank(s, guess, letters_guessed, counts) > 0) {
+        for (int c = 0; c < NUM_LETTERS; c++) {
+            if (!letters_guessed[c] &&
+                (best == '\0' || counts[c] > counts[best - 'a'])) {
+                best = 'a' + c;
+            }
+        }
+        return best;
+    }
+    // The word is not in the index, so fall back on letter frequencies.
+    for (char *l = LETTER_ORDER; *l != '\0'; l++) {
+        if (!letters_guessed[*l - 'a']) {
+            return *l;
+        }
+    }
+    return '\0';
+}
@@ -0,0 +1,37 @@
+#ifndef _SOLVER_H_
+#define _SOLVER_H_
+
+#include <stdint.h>
+
+#include "gameplay.h"
+
+#define SOLVER_MAX_LEN (MAX_WORD - 2)  // Longest word init_game can pick
+
+/* The dictionary words of one length, as bitsets over the words: bit w of
+ * a bitset stands for the w-th word of this length. Matching a pattern is
+ * then a handful of ANDs over nblocks 64-bit blocks, one bitset per
+ * revealed position and guessed letter.
+ */
+struct word_set {
+    int count;        // Words of this length
+    int nblocks;      // 64-bit blocks in each bitset
+    uint64_t *at;     // at[(i * NUM_LETTERS + c) * nblocks]: c at position i
+    uint64_t *has;    // has[c * nblocks]: the word contains c
+    uint32_t *letters;  // letters[w]: bit c is set if word w contains c
+};
+
+/* The dictionary, indexed by word length. */
+struct solver {
+    struct word_set sets[SOLVER_MAX_LEN + 1];
+    uint64_t *scratch;  // The candidates of the current query
+};
+
+extern struct solver engine;
+
+void solver_init(struct solver *s, char *dict_name);
+int solver_rank(struct solver *s, const char *guess,
+                const int *letters_guessed, int *counts);
+char solver_best_letter(struct solver *s, const char *guess,
+                        const int *letters_guessed);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdio.h>
+
+#include "timer.h"
+#include "ratelimit.h"
+
+
+/*
+ * Set list up empty, for timers that last duration microseconds.
+ */
+void timer_list_init(struct timer_list *list, long duration) {
+    list->head.prev = &list->head;
+    list->head.next = &list->head;
+    list->head.deadline = -1;
+    list->duration = duration;
+}
+
+
+/*
+ * Set t up stopped.
+ */
+void timer_init(struct timer *t) {
+    t->prev = NULL;
+    t->next = NULL;
+    t->deadline = -1;
+}
+
+
+/*
+ * Start t so that it fires one duration from now, restarting it if it is
+ * already running.
+ */
+void timer_start(struct timer_list *list, struct timer *t) {
+    timer_stop(t);
+    t->deadline = ratelimit_clock + list->duration;
+    t->prev = list->head.prev;
+    t->next = &list->head;
+    list->head.prev->next = t;
+    list->head.prev = t;
+}
+
+
+/*
+ * Stop t if it is running.
+ */
+void timer_stop(struct timer *t) {
+    if (t->deadline == -1) {
+        return;
+    }
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+    t->deadline = -1;
+}
+
+
+/*
+ * Stop and return the first timer in list whose deadline has passed, or
+ * return NULL if none has.
+ */
+struct timer *timer_expired(struct timer_list *list) {
+    struct timer *t = list->head.next;
+    if (t == &list->head || t->deadline > ratelimit_clock) {
+        return NULL;
+    }
+    timer_stop(t);
+    return t;
+}
+
+
+/*
+ * Return the deadline of the first timer in list to fire, or -1 if none is
+ * running.
+ */
+long timer_next(struct timer_list *list) {
+    struct timer *t = list->head.next;
+    return t == &list->head ? -1 : t->deadline;
+}
@@ -0,0 +1,28 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/* A one-shot timer that can be embedded in whatever it times. */
+struct timer {
+    struct timer *prev;
+    struct timer *next;
+    long deadline;        // ratelimit_clock when it fires, or -1 if stopped
+};
+
+/* Running timers that all last the same time, in the order they fire.
+ * Every timer started later fires later, so keeping the list sorted only
+ * takes appending, and starting, stopping and finding the next timer to
+ * fire are all O(1) however many are running.
+ */
+struct timer_list {
+    struct timer head;    // Before the first timer and after the last
+    long duration;        // Microseconds from start to deadline
+};
+
+void timer_list_init(struct timer_list *list, long duration);
+void timer_init(struct timer *t);
+void timer_start(struct timer_list *list, struct timer *t);
+void timer_stop(struct timer *t);
+struct timer *timer_expired(struct timer_list *list);
+long timer_next(struct timer_list *list);
+
+#endif
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+#include "mem.h"
+
+int tracing = 0;
+struct trace_tick *trace_current = NULL;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+/* When the pass through the event loop in progress started. */
+long trace_tick_start = 0;
+/* The size class of the room of the line being handled. */
+int trace_class = 0;
+struct histogram histograms[NUM_STAGES][NUM_SIZE_CLASSES];
+
+char *stage_names[NUM_STAGES] = {"read", "line", "evaluated", "queued",
+                                 "flushed"};
+
+/*
+ * Return the time in nanoseconds on a clock that only moves forward.
+ */
+long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+/*
+ * Return the size class of a room with n clients in it.
+ */
+int size_class(int n) {
+    int c = n > 1 ? 31 - __builtin_clz(n) : 0;
+    return c < NUM_SIZE_CLASSES ? c : NUM_SIZE_CLASSES - 1;
+}
+
+
+/*
+ * Note the start of a pass through the event loop.
+ */
+void trace_begin_tick() {
+    if (tracing) {
+        trace_tick_start = now_ns();
+    }
+}
+
+
+/*
+ * Note that the lines handled from now on are in a room whose broadcasts
+ * go to n clients, so that their stages are recorded under its size.
+ */
+void trace_room(int n) {
+    trace_class = size_class(n);
+}
+
+
+/*
+ * Record that the line being handled reached stage. The pass gets a
+ * trace_tick when its first line arrives, so passes without input from
+ * players cost nothing more.
+ */
+void trace_stage(int stage) {
+    struct trace_tick *t = trace_current;
+    if (t == NULL) {
+        t = mem_malloc(MEM_SERVER, sizeof(struct trace_tick));
+        if (t == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        t->start = trace_tick_start;
+        t->sends = 0;
+        t->nsamples = 0;
+        trace_current = t;
+    }
+    if (t->nsamples < TRACE_MAX_SAMPLES) {
+        t->stages[t->nsamples] = stage;
+        t->classes[t->nsamples] = trace_class;
+        t->ns[t->nsamples] = now_ns() - t->start;
+        t->nsamples++;
+    }
+}
+
+
+/*
+ * Detach the trace of the pass that is ending, so that it can be completed
+ * once its output has been sent.
+ * Return it, or NULL if the pass handled no lines from players.
+ */
+struct trace_tick *trace_end_tick() {
+    struct trace_tick *t = trace_current;
+    trace_current = NULL;
+    return t;
+}
+
+
+/*
+ * Return the index of the bucket that holds value.
+ */
+int hist_index(long value) {
+    if (value < (1 << HIST_SUB_BITS)) {
+        return value < 0 ? 0 : value;
+    }
+    int e = 63 - __builtin_clzl(value);
+    int sub = (value >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+
+/*
+ * Return the largest value that falls in bucket i.
+ */
+long hist_value(int i) {
+    if (i < (1 << HIST_SUB_BITS)) {
+        return i;
+    }
+    int e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    long sub = i & ((1 << HIST_SUB_BITS) - 1);
+    long width = 1L << (e - HIST_SUB_BITS);
+    return (((1L << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS)) + width - 1;
+}
+
+
+/*
+ * Add value to h.
+ */
+void hist_record(struct histogram *h, long value) {
+    h->buckets[hist_index(value)]++;
+    h->count++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+
+/*
+ * Return the value below which a fraction q of the values in h fall.
+ */
+long hist_percentile(struct histogram *h, double q) {
+    long target = (long)(q * h->count + 0.5);
+    long seen = 0;
+    if (target < 1) {
+        target = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            long v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+
+/*
+ * Now that the output of the pass traced in t has been sent, add its
+ * timings to the histograms, each under the size of its own line's room,
+ * together with one flush time for each line, and free it.
+ */
+void trace_complete(struct trace_tick *t) {
+    if (t == NULL) {
+        return;
+    }
+    long flushed = now_ns() - t->start;
+    for (int i = 0; i < t->nsamples; i++) {
+        int c = t->classes[i];
+        hist_record(&histograms[t->stages[i]][c], t->ns[i]);
+        if (t->stages[i] == STAGE_LINE) {
+            hist_record(&histograms[STAGE_FLUSHED][c], flushed);
+        }
+    }
+    mem_free(t);
+}
+
+
+/*
+ * Ask for the server's statistics to be dumped. Installed for SIGUSR1; the
+ * event loop does the dumping, outside the signal handler.
+ */
+void trace_signal(int sig) {
+    trace_dump_requested = 1;
+}
+
+
+/*
+ * Print a table of every stage and room size that has been recorded, in
+ * microseconds since the event loop woke up.
+ */
+void trace_dump(FILE *fp) {
+    if (!tracing) {
+        fprintf(fp, "Tracing is off; start the server with -T\n");
+        return;
+    }
+    fprintf(fp, "%-10s %11s %10s %9s %9s %9s %9s %9s\n", "stage", "room",
+            "count", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int s = 0; s < NUM_STAGES; s++) {
+        for (int c = 0; c < NUM_SIZE_CLASSES; c++) {
+            struct histogram *h = &histograms[s][c];
+            char room[32];
+            if (h->count == 0) {
+                continue;
+            }
+            if (c == NUM_SIZE_CLASSES - 1) {
+                sprintf(room, "%d+", 1 << c);
+            } else {
+                sprintf(room, "%d-%d", c == 0 ? 0 : 1 << c, (2 << c) - 1);
+            }
+            fprintf(fp, "%-10s %11s %10ld %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                    stage_names[s], room, h->count,
+                    hist_percentile(h, 0.5) / 1e3,
+                    hist_percentile(h, 0.9) / 1e3,
+                    hist_percentile(h, 0.99) / 1e3,
+                    hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+        }
+    }
+    fflush(fp);
+}
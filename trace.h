@@ -0,0 +1,70 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <signal.h>
+
+/* Stages of handling a line from a player, each timed from the moment the
+ * event loop woke up with input ready.
+ */
+#define STAGE_READ 0       // The player's input is being handled
+#define STAGE_LINE 1       // A complete line has been taken from the input
+#define STAGE_EVALUATED 2  // The guess has been applied to the game
+#define STAGE_QUEUED 3     // Everything the guess produced has been queued
+#define STAGE_FLUSHED 4    // The last client has been sent its output
+#define NUM_STAGES 5
+
+/* Histograms are kept per stage and per room size, where the room is
+ * everyone who receives a broadcast: class c holds 2^c to 2^(c+1) - 1.
+ */
+#define NUM_SIZE_CLASSES 14
+
+/* Log-linear buckets in the style of an HDR histogram: every power of two
+ * is split into 2^HIST_SUB_BITS buckets, so a value is recorded to within
+ * 1/16 (6.25%) whatever its magnitude.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+#define TRACE_MAX_SAMPLES 256  // Stage timings kept for one pass
+
+/* Latencies in nanoseconds. */
+struct histogram {
+    long count;
+    long max;
+    long buckets[HIST_BUCKETS];
+};
+
+/* The stage timings of one pass through the event loop, waiting until its
+ * output has been sent before they go into the histograms.
+ */
+struct trace_tick {
+    long start;      // When the event loop woke up
+    int sends;       // Sends of the pass still in flight (io_uring only)
+    int nsamples;
+    unsigned char stages[TRACE_MAX_SAMPLES];
+    unsigned char classes[TRACE_MAX_SAMPLES];  // The size of each one's room
+    long ns[TRACE_MAX_SAMPLES];
+};
+
+/* Set by -T. Everything below does nothing when it is 0. */
+extern int tracing;
+/* The pass being traced, once it has handled a line from a player. */
+extern struct trace_tick *trace_current;
+extern volatile sig_atomic_t trace_dump_requested;
+
+/* Record that the current line from a player reached stage. Costs one
+ * branch when tracing is off.
+ */
+#define TRACE_STAGE(stage) \
+    do { if (tracing) trace_stage(stage); } while (0)
+
+void trace_begin_tick();
+void trace_room(int n);
+void trace_stage(int stage);
+struct trace_tick *trace_end_tick();
+void trace_complete(struct trace_tick *t);
+void trace_signal(int sig);
+void trace_dump(FILE *fp);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "upgrade.h"
+
+/*
+ * Fill addr with the Unix domain address path.
+ */
+void upgrade_addr(struct sockaddr_un *addr, char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+
+/*
+ * Listen for a new server binary on the Unix domain socket path, replacing
+ * whatever is there (normally the socket of the server we took over from).
+ * Sequenced packets keep each batch of descriptors with its records.
+ */
+int upgrade_listen(char *path) {
+    struct sockaddr_un addr;
+    upgrade_addr(&addr, path);
+
+    int soc = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (soc < 0) {
+        perror("socket");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(soc, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(soc, 16) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return soc;
+}
+
+
+/*
+ * Connect to a running server's upgrade socket at path.
+ * Return the socket, or -1 if no server is listening there.
+ */
+int upgrade_connect(char *path) {
+    struct sockaddr_un addr;
+    upgrade_addr(&addr, path);
+
+    int soc = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (soc < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(soc, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(soc);
+        return -1;
+    }
+    return soc;
+}
+
+
+/*
+ * Send len bytes of data as one message on sock, passing the nfds socket
+ * descriptors in fds along with it.
+ * Return 0 on success, 1 if sock is non-blocking and has no room for the
+ * message yet, and -1 on error.
+ */
+int send_with_fds(int sock, void *data, int len, int *fds, int nfds) {
+    char control[CMSG_SPACE(UPGRADE_BATCH * sizeof(int))];
+    struct iovec iov = {data, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    int n = sendmsg(sock, &msg, 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 1;
+    }
+    if (n != len) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Receive one message of exactly len bytes into data, and the socket
+ * descriptors passed with it (at most max_fds) into fds.
+ * Return the number of descriptors received, or -1 on error or if the
+ * other end has closed the socket.
+ */
+int recv_with_fds(int sock, void *data, int len, int *fds, int max_fds) {
+    char control[CMSG_SPACE(UPGRADE_BATCH * sizeof(int))];
+    struct iovec iov = {data, len};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int n = recvmsg(sock, &msg, 0);
+    if (n != len) {
+        if (n < 0) {
+            perror("recvmsg");
+        } else if (n > 0) {
+            fprintf(stderr, "Message was %d bytes, expected %d\n", n, len);
+        }
+        return -1;
+    }
+
+    int nfds = 0;
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (nfds > max_fds) {
+                fprintf(stderr, "Too many descriptors in message\n");
+                return -1;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+    }
+    return nfds;
+}
@@ -0,0 +1,52 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+#include "gameplay.h"
+
+#define UPGRADE_MAGIC 0x77737572  // "wsur": the format with rooms
+#define UPGRADE_BATCH 250         // Records per message; below SCM_MAX_FD
+#define UPGRADE_DRAIN 1000000L    // Microseconds clients get to take their
+                                  // waiting output before a handoff
+
+/* Which list a handed-over client belongs in. */
+#define ROLE_PLAYER 0
+#define ROLE_NEW_PLAYER 1
+#define ROLE_SPECTATOR 2
+
+/* The first message of a handoff. It carries the listening socket. */
+struct upgrade_header {
+    unsigned int magic;
+    int nrooms;
+    int nclients;
+    int dict_size;
+};
+
+/* One room. Rooms are sent UPGRADE_BATCH at a time after the header. */
+struct upgrade_room {
+    char word[MAX_WORD];
+    char guess[MAX_WORD];
+    int letters_guessed[NUM_LETTERS];
+    int guesses_left;
+    int turn;               // Index of has_next_turn among the clients, or -1
+};
+
+/* One client. Records are sent UPGRADE_BATCH at a time after the rooms,
+ * each batch with the matching socket descriptors attached. Players are
+ * sent in list order, which is also the turn order.
+ */
+struct upgrade_client {
+    int role;
+    int room;                // Index among the rooms sent, or -1
+    struct in_addr ipaddr;
+    char name[MAX_NAME];
+    int inlen;               // Bytes of a partial line not yet handled
+    char inbuf[MAX_BUF];
+};
+
+/* Sequenced-packet Unix domain sockets, also used by cluster mode. */
+int upgrade_listen(char *path);
+int upgrade_connect(char *path);
+int send_with_fds(int sock, void *data, int len, int *fds, int nfds);
+int recv_with_fds(int sock, void *data, int len, int *fds, int max_fds);
+
+#endif
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "mem.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/*
+ * Undo whatever uring_init had set up of ring before it failed.
+ */
+static void uring_teardown(struct uring *ring) {
+    if (ring->bufs != NULL) {
+        mem_free(ring->bufs);
+    }
+    if (ring->br != NULL) {
+        munmap(ring->br, URING_NUM_BUFS * sizeof(struct io_uring_buf));
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->map != NULL) {
+        munmap(ring->map, ring->map_len);
+    }
+    close(ring->fd);
+}
+
+
+/*
+ * Set up ring with room for entries submissions, map its queues and give
+ * the kernel URING_NUM_BUFS receive buffers.
+ * Return 0 on success and -1 if the kernel does not support what we need,
+ * in which case the caller should fall back to another event loop.
+ */
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        uring_teardown(ring);
+        return -1;
+    }
+
+    // With IORING_FEAT_SINGLE_MMAP the submission and completion rings
+    // share one mapping.
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes
+                    + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_len = sq_len > cq_len ? sq_len : cq_len;
+    char *sq = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        perror("mmap");
+        uring_teardown(ring);
+        return -1;
+    }
+    ring->map = sq;
+    ring->map_len = ring_len;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(sq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(sq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(sq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(sq + params.cq_off.cqes);
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap");
+        ring->sqes = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+    ring->sqe_tail = *ring->sq_tail;
+    ring->sqe_submitted = ring->sqe_tail;
+
+    // Register the ring of provided receive buffers.
+    ring->br = mmap(NULL, URING_NUM_BUFS * sizeof(struct io_uring_buf),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1, 0);
+    if (ring->br == MAP_FAILED) {
+        perror("buffer ring");
+        ring->br = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+    ring->bufs = mem_malloc(MEM_BUFFERS, URING_NUM_BUFS * URING_BUF_SIZE);
+    if (ring->bufs == NULL) {
+        perror("buffer ring");
+        uring_teardown(ring);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->br;
+    reg.ring_entries = URING_NUM_BUFS;
+    reg.bgid = URING_BGID;
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register");
+        uring_teardown(ring);
+        return -1;
+    }
+    for (int bid = 0; bid < URING_NUM_BUFS; bid++) {
+        uring_recycle_buf(ring, bid);
+    }
+    return 0;
+}
+
+
+/*
+ * Return a cleared submission queue entry for the caller to fill in. If
+ * the queue is full, what is already in it is submitted first.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        uring_submit_and_wait(ring, 0);
+    }
+
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+
+/*
+ * Submit everything queued since the last call in one system call and
+ * wait until at least wait_nr completions are available.
+ * Return 0 on success and -1 on error.
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    ring->sqe_submitted = ring->sqe_tail;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (io_uring_enter(ring->fd, to_submit, wait_nr, flags) < 0) {
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Return the oldest unseen completion, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+
+/*
+ * Hand the completion returned by uring_peek_cqe back to the kernel.
+ */
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Return the receive buffer with id bid.
+ */
+char *uring_buf(struct uring *ring, int bid) {
+    return ring->bufs + bid * URING_BUF_SIZE;
+}
+
+
+/*
+ * Give the receive buffer with id bid back to the kernel.
+ */
+void uring_recycle_buf(struct uring *ring, int bid) {
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (URING_NUM_BUFS - 1)];
+    buf->addr = (unsigned long)uring_buf(ring, bid);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
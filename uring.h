@@ -0,0 +1,50 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024  // Submission queue size
+#define URING_NUM_BUFS 1024 // Receive buffers handed to the kernel; power of 2
+#define URING_BUF_SIZE 512  // Size of each receive buffer
+#define URING_BGID 0        // Buffer group id of the receive buffers
+
+/* A minimal io_uring instance, driven with the raw system calls so that
+ * the server does not need liburing. Receives use a ring of provided
+ * buffers so that a multishot recv can stay armed on every client without
+ * tying up a buffer per connection.
+ */
+struct uring {
+    int fd;
+    char *map;               // The rings' shared mapping
+    size_t map_len;
+
+    // Submission queue, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;       // Entries handed out by uring_get_sqe
+    unsigned sqe_submitted;  // Entries already passed to the kernel
+
+    // Completion queue, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided receive buffers
+    struct io_uring_buf_ring *br;
+    char *bufs;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+char *uring_buf(struct uring *ring, int bid);
+void uring_recycle_buf(struct uring *ring, int bid);
+
+#endif
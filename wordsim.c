@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "gameplay.h"
+
+/* A headless simulator that plays games straight through the game engine
+ * in gameplay.c, with no sockets, no event loop and no server. Each worker
+ * process runs one room of simulated players through its share of the
+ * games, so the rules can be benchmarked on every core and fuzzed apart
+ * from the networking.
+ */
+
+#define SIM_PLAYERS 4          // Players in the simulated room unless -n
+#define FUZZ_LINES "aezAE!"    // What a fuzzing player may send, besides
+                               // letters it has not tried yet
+
+/* What one worker did, sent back to the parent through a pipe. */
+struct sim_stats {
+    long games;
+    long won;
+    long guesses;
+    long refused;
+    long skipped;
+    long left;
+};
+
+/* The words of the dictionary, loaded once before the workers fork. */
+char (*words)[MAX_WORD] = NULL;
+int nwords = 0;
+
+int fuzzing = 0;
+
+
+/*
+ * Load every word of dict_name into words.
+ */
+void load_words(char *dict_name) {
+    char buf[MAX_WORD];
+    nwords = get_file_length(dict_name);
+    words = malloc(nwords * sizeof(*words));
+    FILE *fp = fopen(dict_name, "r");
+    if (words == NULL || fp == NULL || nwords == 0) {
+        perror("Loading dictionary");
+        exit(1);
+    }
+    for (int i = 0; i < nwords && fgets(buf, MAX_WORD, fp) != NULL; i++) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        strcpy(words[i], buf);
+    }
+    fclose(fp);
+}
+
+
+/*
+ * Return the next number from the xorshift generator in *state. Each
+ * worker has its own, so the workers share nothing.
+ */
+unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+
+/*
+ * Check that game is in a state the rules allow, and abort with a
+ * description of it if not.
+ */
+void check_game(struct game_state *game, const char *after) {
+    char *problem = NULL;
+    int guessed = 0;
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        guessed += game->letters_guessed[i];
+    }
+    if (game->guesses_left < 0 || game->guesses_left > MAX_GUESSES) {
+        problem = "guesses_left out of range";
+    }
+    else if (guessed > MAX_GUESSES - game->guesses_left) {
+        problem = "more letters guessed than guesses spent";
+    }
+    else if (strlen(game->guess) != strlen(game->word)) {
+        problem = "guess and word differ in length";
+    }
+    for (int j = 0; problem == NULL && game->word[j] != '\0'; j++) {
+        char c = game->word[j];
+        int shown = c >= 'a' && c <= 'z' && game->letters_guessed[c - 'a'];
+        if (game->guess[j] != (shown ? c : '-')) {
+            problem = "guess does not match the letters guessed";
+        }
+    }
+    if (problem == NULL && (game->head == NULL) !=
+        (game->has_next_turn == NULL)) {
+        problem = "turn held in an empty game, or nobody holds it";
+    }
+    if (problem == NULL && game->has_next_turn != NULL) {
+        struct client *p;
+        for (p = game->head; p != NULL && p != game->has_next_turn;
+             p = p->next)
+            ;
+        if (p == NULL) {
+            problem = "turn held by someone not in the game";
+        }
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "After %s: %s (word %s, guess %s, %d left)\n",
+                after, problem, game->word, game->guess, game->guesses_left);
+        abort();
+    }
+}
+
+
+/*
+ * Return the player who sends the next line: whoever has the turn or,
+ * when fuzzing, anyone.
+ */
+struct client *next_sender(struct game_state *game, struct client *players,
+                           int nplayers, unsigned long *rng) {
+    if (!fuzzing) {
+        return game->has_next_turn;
+    }
+    struct client *p = &players[next_random(rng) % nplayers];
+    return p->room == game ? p : game->has_next_turn;
+}
+
+
+/*
+ * Fill line with what p sends: a letter nobody has tried yet or, when
+ * fuzzing, sometimes something the rules should refuse.
+ */
+void next_line(struct game_state *game, char *line, unsigned long *rng) {
+    unsigned long r = next_random(rng);
+    int nfuzz = strlen(FUZZ_LINES);
+    if (fuzzing && r % 4 == 0) {
+        int k = (r >> 2) % (nfuzz + 2);
+        if (k == nfuzz) {
+            strcpy(line, "");
+        }
+        else if (k == nfuzz + 1) {
+            strcpy(line, "ab");
+        }
+        else {
+            line[0] = FUZZ_LINES[k];
+            line[1] = '\0';
+        }
+        return;
+    }
+    int c = (r >> 2) % NUM_LETTERS;
+    while (game->letters_guessed[c]) {
+        c = (c + 1) % NUM_LETTERS;
+    }
+    line[0] = 'a' + c;
+    line[1] = '\0';
+}
+
+
+/*
+ * Tally events into stats. Return 1 if they ended the game.
+ */
+int count_events(struct game_events *ev, struct sim_stats *stats) {
+    int over = 0;
+    for (int i = 0; i < ev->n; i++) {
+        switch (ev->ev[i].type) {
+        case GAME_REFUSED:
+            stats->refused++;
+            break;
+        case GAME_GUESSED:
+            stats->guesses++;
+            break;
+        case GAME_WON:
+            stats->won++;
+            over = 1;
+            break;
+        case GAME_LOST:
+            over = 1;
+            break;
+        }
+    }
+    ev->n = 0;
+    return over;
+}
+
+
+/*
+ * Play games games in one room of nplayers players, seeded with seed, and
+ * return what happened. When fuzzing, players also send lines out of turn
+ * and lines that are not guesses, turns are skipped, and players leave and
+ * join again, and the game is checked after every step.
+ */
+struct sim_stats run_worker(long games, int nplayers, unsigned long seed) {
+    struct sim_stats stats = {0, 0, 0, 0, 0, 0};
+    struct game_state game;
+    struct game_events ev;
+    struct client *players = calloc(nplayers, sizeof(struct client));
+    unsigned long rng = seed * 2654435761UL + 1;
+    char line[3];
+
+    if (players == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    memset(&game, 0, sizeof(game));
+    ev.n = 0;
+    for (int i = 0; i < nplayers; i++) {
+        players[i].fd = -1 - i;
+        sprintf(players[i].name, "sim%d", i);
+        game_join(&game, &players[i], &ev);
+    }
+    ev.n = 0;
+
+    while (stats.games < games) {
+        game_start(&game, words[next_random(&rng) % nwords]);
+        game_turn(&game, &ev);
+        int over = count_events(&ev, &stats);
+        while (!over) {
+            unsigned long r = next_random(&rng);
+            if (fuzzing && r % 16 == 0) {
+                game_skip(&game, (r >> 4) & 1, &ev);
+                stats.skipped++;
+                over = count_events(&ev, &stats);
+                check_game(&game, "a skip");
+                continue;
+            }
+            if (fuzzing && r % 16 == 1) {
+                // One player leaves and takes a seat again.
+                struct client *p = &players[(r >> 4) % nplayers];
+                game_leave(&game, p, &ev);
+                check_game(&game, "a leave");
+                game_join(&game, p, &ev);
+                game_turn(&game, &ev);
+                stats.left++;
+                over = count_events(&ev, &stats);
+                check_game(&game, "a join");
+                continue;
+            }
+            struct client *p = next_sender(&game, players, nplayers, &rng);
+            next_line(&game, line, &rng);
+            game_guess(&game, p, line, &ev);
+            over = count_events(&ev, &stats);
+            if (fuzzing) {
+                check_game(&game, "a guess");
+            }
+        }
+        if (!game_over(&game)) {
+            fprintf(stderr, "A game ended that is not over\n");
+            abort();
+        }
+        stats.games++;
+    }
+    free(players);
+    return stats;
+}
+
+
+/*
+ * Print how to run the simulator and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-j workers] [-g games] [-n players] "
+            "[-s seed] [-f] <dictionary filename>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    long games = 10000000;
+    int nplayers = SIM_PLAYERS;
+    unsigned long seed = time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:g:n:s:f")) != -1) {
+        switch (opt) {
+        case 'j':
+            workers = strtol(optarg, NULL, 10);
+            break;
+        case 'g':
+            games = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            nplayers = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            fuzzing = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || workers < 1 || games < 1 || nplayers < 1) {
+        usage(argv[0]);
+    }
+    load_words(argv[optind]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    for (int w = 0; w < workers; w++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            // The first workers take the games that do not divide evenly.
+            long share = games / workers + (w < games % workers);
+            struct sim_stats stats = run_worker(share, nplayers, seed + w);
+            if (write(fds[1], &stats, sizeof(stats)) != sizeof(stats)) {
+                perror("write");
+                _exit(1);
+            }
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+
+    // Each report is smaller than PIPE_BUF, so none is split or interleaved.
+    struct sim_stats total = {0, 0, 0, 0, 0, 0};
+    struct sim_stats stats;
+    int reports = 0;
+    while (read(fds[0], &stats, sizeof(stats)) == sizeof(stats)) {
+        total.games += stats.games;
+        total.won += stats.won;
+        total.guesses += stats.guesses;
+        total.refused += stats.refused;
+        total.skipped += stats.skipped;
+        total.left += stats.left;
+        reports++;
+    }
+    int failed = 0;
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) +
+                  (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%ld games (%ld won) in %.3fs on %d workers: %.0f games/s, "
+           "%.0f guesses/s\n", total.games, total.won, secs, workers,
+           total.games / secs, total.guesses / secs);
+    if (fuzzing) {
+        printf("%ld lines refused, %ld turns skipped, %ld players left and "
+               "rejoined, seed %lu\n", total.refused, total.skipped,
+               total.left, seed);
+    }
+    if (failed > 0 || reports != workers) {
+        fprintf(stderr, "%d of %d workers failed\n", failed, workers);
+        return 1;
+    }
+    return 0;
+}
@@ -2,24 +2,42 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include "socket.h"
 #include "gameplay.h"
+#include "uring.h"
+#include "record.h"
+#include "names.h"
+#include "lobby.h"
+#include "checkpoint.h"
+#include "upgrade.h"
+#include "cluster.h"
+#include "solver.h"
+#include "trace.h"
+#include "mem.h"
+#include "pool.h"
+#include "timer.h"
 
 
 #ifndef PORT
     #define PORT 52061
 #endif
-#define MAX_QUEUE 5
+#define MAX_QUEUE 128
+#define HINT_LETTERS 3     // Letters suggested by a hint
+#define MAX_BOT_MOVES 64   // Bot guesses per pass through the event loop
 
 
 void add_player(struct client **top, int fd, struct in_addr addr);
@@ -29,36 +47,253 @@ void broadcast(struct game_state *game, char *outbuf);
 void announce_turn(struct game_state *game);
 /* Move the has_next_turn pointer to the next active client */
 void advance_turn(struct game_state *game);
+/* Close a client's socket descriptor */
+void close_client(struct client *p);
+/* Refuse a newly accepted client if its address is over its limits */
+int admit_connection(int clientfd, struct in_addr addr);
+/* Check a client's line against its rate limit */
+int line_allowed(struct client *p);
+/* Set up a newly accepted client as a new player */
+struct client *new_connection(int clientfd, struct in_addr addr,
+                              struct client **new_player_list);
+/* Run the server with poll */
+void run_poll_loop(int listenfd, struct client **new_player_list);
+/* Feed a recording through the game as fast as possible */
+void run_replay(FILE *fp, struct client **new_player_list);
+/* Cancel io_uring requests on a client that is being closed */
+void uring_forget(struct client *p);
+/* Queue one io_uring send of a client's waiting output */
+void uring_flush_client(struct client *p);
+/* Run the server with io_uring */
+void run_uring_loop(int listenfd, struct client **new_player_list);
+/* Handle bytes read from a client's socket descriptor */
+void handle_input(struct client *p, const char *buf, int len,
+                  struct client **new_player_list);
+/* Note that p is the client on socket descriptor fd */
+void set_fd_client(int fd, struct client *p);
+/* Return the client on socket descriptor fd, or NULL if there is none */
+struct client *fd_client(int fd);
+/* Buffer input from a client */
+int append_input(struct client *p, const char *buf, int len);
+/* Take the next complete line of input from a client */
+int next_line(struct client *p, char *line);
 /* Handle inputted name from a new player */
-void handle_client_name(struct client *p, struct client **new_player_list,
-                        struct game_state *game);
+int handle_client_name(struct client *p, struct client **new_player_list,
+                       char *line);
 /* Handle inputted guess from an active player */
-void handle_client_guess(struct client *p, struct game_state *game);
+void handle_client_guess(struct client *p, struct game_state *game,
+                         char *line);
 /* Check if name is already in player list */
-int check_name(char *name, struct game_state *game);
-/* Count number of players in player list */
-int count_players(struct game_state *game);
+int check_name(char *name);
 /* Search and return player */
 struct client *search(int fd, struct game_state *game);
 /* Move player from the new player list to the game. */
 void move_player(struct client **new_player_list, struct client *player,
-                  struct game_state *game, int fd);
+                 struct game_state *game, struct game_events *ev);
 /* Start a new game. */
 void new_game(struct game_state *game);
 /* Display the current gameboard. */
 void display_game(struct game_state *game, int fd);
-/* Disconnect player from new player list. */
-void disconnect_newplayer(struct client **new_player_list, struct client *p);
-/* Disconnect player from active list. */
-void disconnect_activeplayer(struct game_state *game, struct client *p);
+/* Mark a client as disconnected. */
+void disconnect_client(struct client *p);
+/* Remove every client marked as disconnected. */
+int reap_clients(struct client **new_player_list);
+/* Remove the disconnected clients from a list of clients. */
+int reap_list(struct client **top, struct client **graveyard);
+/* Finish a pass through the event loop. */
+void finish_tick(struct client **new_player_list);
 /* Find network newline in buf. */
 int find_network_newline(const char *buf, int n);
+/* Queue a message for a single client. */
+void send_message(struct client *p, char *msg);
+/* Queue a rendered message for a single client, unless it is a bot. */
+void queue_message(struct client *p, struct message *m);
+/* Forget the clients that no longer have output waiting. */
+void prune_pending();
+/* Tell the players in a room what the game engine did. */
+void play_events(struct game_state *game, struct game_events *ev);
+/* Tell a room whose turn it is. */
+void tell_turn(struct game_state *game, struct client *has_turn);
+/* Tell a room about a guess that was made. */
+void tell_guess(struct game_state *game, struct client *p, char letter,
+                int in_word);
+/* Tell a room how its game ended and start the next one. */
+void tell_game_over(struct game_state *game, struct client *winner);
+/* Free a client that has already been unlinked from its list. */
+void free_client(struct client *p);
+/* Write all queued output, one writev per client. */
+void flush_clients();
+/* Write what is queued for one client before it is disconnected. */
+void flush_client(struct client *p);
+/* Return the client after p in a walk over every client. */
+struct client *next_client(struct client *new_players, struct client *p);
 
-/* The set of socket descriptors for select to monitor.
- * This is a global variable because we need to remove socket descriptors
- * from allset when a write to a socket fails.
+/* Open a new room with a fresh game. */
+struct game_state *open_room();
+/* Free a room that nobody is in any more. */
+void retire_room(struct game_state *room);
+/* Seat the players waiting in the lobby, filling the fullest rooms first. */
+void seat_waiting_players(struct client **new_player_list);
+/* Display the current gameboard to every spectator. */
+void display_spectators(struct game_state *game);
+/* Move a new player to the spectator list. */
+void make_spectator(struct client **new_player_list, struct client *p);
+/* Handle a line of input from a spectator. */
+void handle_spectator_line(struct client *p);
+/* Stop all io_uring activity ahead of an upgrade. */
+void uring_quiesce(int listenfd, struct client **new_player_list);
+/* Restart io_uring activity after a failed upgrade. */
+void uring_resume(int listenfd, struct client **new_player_list);
+/* Hand the server over to a new binary connecting on upgrade_fd. */
+void start_upgrade(int listenfd, struct client **new_player_list);
+/* Let clients take their waiting output before an upgrade. */
+void drain_output(struct client **new_player_list);
+/* Send the rooms, the listening socket and every client to a new binary. */
+int hand_off(int sock, int listenfd, struct client *new_players);
+/* Take over the rooms and sockets of the server on the other end of sock. */
+int take_over(int sock, struct client **new_player_list);
+/* Tell a player which letters are most likely to be in the word. */
+void send_hint(struct client *p, struct game_state *game);
+/* Add bots to or remove them from a room to keep it at bot_target. */
+void balance_bots(struct game_state *game);
+/* Add a bot player to a room. */
+void add_bot(struct game_state *game);
+/* Return 1 if a bot has the turn and should guess now. */
+int bot_has_turn(struct game_state *game);
+/* Return 1 if a bot has the turn in any room. */
+int bots_have_turn();
+/* Let bots guess until someone else has the turn. */
+void run_bots(struct game_state *game);
+/* Balance the bots and let them take their turns. */
+void tend_bots(struct client **new_player_list);
+/* Count everyone who receives broadcasts. */
+int count_room(struct game_state *game);
+/* Take the trace of the pass that is ending, if it needs completing. */
+struct trace_tick *end_traced_tick();
+/* Dump the memory counters and latency histograms if SIGUSR1 asked. */
+void check_dump();
+/* Print how much of each pool is in use. */
+void dump_pools();
+/* Take a client handed to this backend by the cluster coordinator. */
+struct client *receive_cluster_client(struct client **new_player_list);
+/* Tell the cluster coordinator this backend's load if it has changed. */
+void cluster_report();
+/* Note a closed client for the next report to the coordinator. */
+void cluster_closed_add(struct in_addr addr);
+/* Fill pollset with every socket descriptor the server is watching. */
+int build_pollset(int listenfd, struct client *new_players);
+/* Reopen the rooms of the last checkpoint and hold their seats. */
+void restore_checkpoint();
+/* Put a returning player back in the seat held for them, if there is one. */
+int reclaim_seat(struct client **new_player_list, struct client *p);
+/* Let go of the seats nobody has come back for. */
+void expire_reservations();
+/* Take a checkpoint or let held seats go if either is due. */
+void tend_checkpoint();
+/* Return when the event loop next has to wake up by itself, or -1. */
+long next_deadline();
+/* Start timing the turn of whoever has it in game, if they are new to it. */
+void start_turn_clock(struct game_state *game);
+/* Pass the turn on from a player who let their time run out. */
+void skip_turn(struct game_state *game);
+/* Skip the turn in every room whose turn clock has run out. */
+void expire_turns();
+/* Return how long poll may wait for input, in milliseconds. */
+int poll_timeout();
+
+/* The socket descriptors for poll to monitor: listenfd, upgrade_fd and
+ * cluster_fd, then every client, then once more each client with output
+ * waiting, to hear when its socket has room for it. The clients' entries
+ * are only rebuilt from the client lists when a client has been added or
+ * freed since the last pass, not on every pass. Unlike an fd_set it has no
+ * FD_SETSIZE limit, which matters once thousands of spectators are
+ * connected.
+ */
+struct pollfd *pollset = NULL;
+int pollset_cap = 0;
+int pollset_clients = 0;    // Entries up to the first one for output
+int pollset_stale = 1;      // A client has been added or freed
+#define POLL_FIRST_CLIENT 3  // After listenfd, upgrade_fd and cluster_fd
+
+/* The clients with output waiting, so that the end of a pass writes to
+ * them without visiting every client. A client is listed from when a
+ * message is queued for it until its queue is empty again or it is
+ * disconnected.
+ */
+struct client **pending = NULL;
+int npending = 0;
+int pending_cap = 0;
+
+/* The Unix domain socket a new server binary connects to in order to take
+ * over from this one, or -1 if upgrades are not enabled (no -U).
+ */
+int upgrade_fd = -1;
+
+/* When running as a cluster backend (-J), the connection to the coordinator
+ * that hands this server its clients, or -1. A backend has no listening
+ * socket of its own.
+ */
+int cluster_fd = -1;
+/* What this backend last told the coordinator. */
+struct cluster_load cluster_load = {0, 0, 0, 0};
+long cluster_received = 0;
+/* The addresses of clients that have closed since the coordinator was last
+ * told, so that it stops counting them against MAX_CONNS_PER_IP.
+ */
+struct in_addr *cluster_closed = NULL;
+int ncluster_closed = 0;
+int cluster_closed_cap = 0;
+/* The clients with a connection, kept up to date as they come and go so
+ * that reporting the load does not mean counting them.
+ */
+int connected_clients = 0;
+
+/* The number of clients marked as disconnected since reap_clients last ran.
+ */
+int dead_clients = 0;
+
+/* With -B n, bots fill each room up to n players. Bots are players with a
+ * negative socket descriptor: they have no socket, are sent nothing, and
+ * guess with the solver engine when they have the turn.
+ */
+int bot_target = 0;
+int next_bot_id = 1;
+
+/* Every struct client, and the input buffers that clients hold only while a
+ * partial line is waiting, come from pools. A mostly idle connection costs
+ * one 128-byte client slot and no buffer.
+ */
+struct pool client_pool = POOL_INIT(sizeof(struct client), 64, MEM_CLIENTS);
+struct pool inbuf_pool = POOL_INIT(MAX_BUF, 64, MEM_BUFFERS);
+/* io_uring state for each connection; defined with struct uring_conn. */
+extern struct pool conn_pool;
+
+/* The client on each socket descriptor, so that input read from a
+ * descriptor reaches its client without a walk over every client. Grown as
+ * higher descriptors are handed out; bots have none.
+ */
+struct client **fd_clients = NULL;
+int fd_clients_cap = 0;
+
+/* With -D seconds, a player who has not made a valid guess that long after
+ * getting the turn loses it. With -G the skipped turn also costs the room a
+ * guess, and a player who lets kick_after turns in a row run out is removed
+ * (-K; 0 never removes anyone).
+ */
+int turn_deadline = 0;
+int turn_costs_guess = 0;
+int kick_after = 3;
+struct timer_list turn_timers;
+/* How well rooms keep moving, printed on SIGUSR1. */
+long games_finished = 0;
+long turns_skipped = 0;
+long players_kicked = 0;
+
+/* The io_uring instance when the server runs with -b uring, otherwise NULL.
+ * Closing a client has to cancel its outstanding io_uring requests, so this
+ * is global for the same reason pollset is.
  */
-fd_set allset;
+struct uring *ring = NULL;
 
 /* Display the current gameboard to client with fd. */
 void display_game(struct game_state *game, int fd) {
@@ -68,294 +303,2302 @@ void display_game(struct game_state *game, int fd) {
   struct client *p;
   for (p = game->head; p != NULL; p = p->next) {
     if (p->fd == fd) {
-      if (write(p->fd, game_display_message,
-                strlen(game_display_message)) == -1) {
-        fprintf(stderr, "Write to client failed\n");
-        disconnect_activeplayer(game, p);
-      };
+      send_message(p, game_display_message);
+    }
+  }
+}
+
+/* Display the current gameboard to every spectator, rendering it once. */
+void display_spectators(struct game_state *game) {
+  char game_display[MAX_MSG];
+  if (game->spectators == NULL) {
+    return;
+  }
+  struct message *m = new_message(status_message(game_display, game));
+  struct client *p;
+  for (p = game->spectators; p != NULL; p = p->next) {
+    queue_message(p, m);
+  }
+  release_message(m);
+}
+
+/*
+ * Create a new game after the previous game finished.
+ */
+void new_game(struct game_state *game) {
+  char buf[MAX_WORD];
+  rewind(game->dict.fp);
+
+  // Choose a random word.
+  int index = random() % game->dict.size;
+  printf("Looking for word at index %d\n", index);
+  for(int i = 0; i <= index; i++) {
+      if(!fgets(buf, MAX_WORD, game->dict.fp)){
+          fprintf(stderr,"File ended before we found the entry index %d",index);
+          exit(1);
+      }
+  }
+
+  if(buf[strlen(buf) - 1] == '\n') {
+      buf[strlen(buf) - 1] = '\0';
+  } else {
+      fprintf(stderr,
+        "The dictionary file does not appear to have Unix line endings\n");
+  }
+  game_start(game, buf);
+  checkpoint.dirty = 1;
+}
+
+/*
+ * Advance the turn and adjust the one who has the next turn.
+ */
+void advance_turn(struct game_state *game) {
+  struct game_events ev;
+  ev.n = 0;
+  game_advance(game, &ev);
+  play_events(game, &ev);
+}
+
+/*
+ * Announce whose turn it is, based on who has the next turn, or how the
+ * game ended if it is over.
+ */
+void announce_turn(struct game_state *game) {
+  struct game_events ev;
+  ev.n = 0;
+  game_turn(game, &ev);
+  play_events(game, &ev);
+}
+
+/*
+ * Turn the events the game engine produced for game into messages for
+ * its players and spectators, in the order they happened.
+ */
+void play_events(struct game_state *game, struct game_events *ev) {
+  // Why a line from a player was not taken as a guess, by REFUSED_ code.
+  static char *refused_msgs[] = {
+    "It's not your turn to guess.\r\n",
+    "Please, enter a non-empty guess.\r\n",
+    "Please, enter a single guess.\r\n",
+    "The letter should be in lower-case.\r\n",
+    "The letter has already been guessed. Try again.\r\n",
+  };
+  char msg[MAX_MSG];
+
+  for (int i = 0; i < ev->n; i++) {
+    struct game_event *e = &ev->ev[i];
+    switch (e->type) {
+    case GAME_JOINED:
+      sprintf(msg, "%s has just joined.\r\n", e->player->name);
+      broadcast(game, msg);
+      if (e->player->fd >= 0) {
+        display_game(game, e->player->fd);
+      }
+      break;
+    case GAME_LEFT:
+      if (game->head != NULL) {
+        sprintf(msg, "%s left the game.\r\n", e->player->name);
+        broadcast(game, msg);
+      }
+      break;
+    case GAME_REFUSED:
+      send_message(e->player, refused_msgs[e->detail]);
+      break;
+    case GAME_GUESSED:
+      tell_guess(game, e->player, e->letter, e->detail);
+      break;
+    case GAME_TURN:
+      tell_turn(game, e->player);
+      break;
+    case GAME_WON:
+      tell_game_over(game, e->player);
+      break;
+    case GAME_LOST:
+      tell_game_over(game, NULL);
+      break;
+    }
+  }
+}
+
+/*
+ * Tell every player and spectator in game that it is has_turn's turn,
+ * prompt has_turn for a guess and start timing them.
+ */
+void tell_turn(struct game_state *game, struct client *has_turn) {
+  char turn[MAX_MSG];
+  sprintf(turn, "It's %s's turn.\r\n", has_turn->name);
+  char *guess_msg = "Your guess?\r\n";
+
+  struct message *turn_msg = new_message(turn);
+  struct client *p;
+  for (p = game->head; p != NULL; p = p->next) {
+    // If the player does not have the next turn, announce whose turn it is.
+    if (p != has_turn) {
+      queue_message(p, turn_msg);
+    }
+    // If the player does have the next turn, prompt guess.
+    else {
+      send_message(p, guess_msg);
     }
   }
+  for (p = game->spectators; p != NULL; p = p->next) {
+    queue_message(p, turn_msg);
+  }
+  release_message(turn_msg);
+  start_turn_clock(game);
+}
+
+/*
+ * Tell game that p guessed letter and show everyone the gameboard.
+ */
+void tell_guess(struct game_state *game, struct client *p, char letter,
+                int in_word) {
+  char *incorrect_guess = "That was an incorrect guess.\r\n";
+  // String to hold the current guess.
+  char announce_guess[MAX_BUF];
+
+  checkpoint.dirty = 1;
+  // Whoever has the turn next gets a fresh clock, even if it is p again.
+  game->clock_holder = NULL;
+  p->missed = 0;
+  // Bots guess outside the passes that are traced.
+  if (p->fd >= 0) {
+    TRACE_STAGE(STAGE_EVALUATED);
+  }
+
+  if (in_word) {
+    printf("That was a correct guess by %s.\n", p->name);
+  }
+  else {
+    send_message(p, incorrect_guess);
+    printf("That was an incorrect guess by %s.\n", p->name);
+  }
+  sprintf(announce_guess, "%s guesses: %c\r\n", p->name, letter);
+  broadcast(game, announce_guess);
+  display_game(game, p->fd);
+  display_spectators(game);
 }
 
-/* Disconnect a new player from new_player_list. */
-void disconnect_newplayer(struct client **new_player_list, struct client *p) {
-  int dp_fd = p->fd;
+/*
+ * Reveal the word, say who won (nobody if winner is NULL), and start a new
+ * game with the same players.
+ */
+void tell_game_over(struct game_state *game, struct client *winner) {
+  char msg[MAX_MSG];
+
+  sprintf(msg, "The word was %s.\r\n", game->word);
+  broadcast(game, msg);
+  if (winner != NULL) {
+    sprintf(msg, "Game over. %s won!\r\n", winner->name);
+    broadcast(game, msg);
+  }
+  else {
+    broadcast(game, "Game over. You've exhausted all the guesses.\r\n");
+  }
+  games_finished++;
+  // Create a new game.
+  broadcast(game, "Let's start a new game.\r\n");
+  new_game(game);
+  broadcast(game, status_message(msg, game));
+  announce_turn(game);
+}
 
+/*
+ * Move a player from the new_player_list to the active game list, adding
+ * what the game engine makes of it to ev. The client itself moves, so its
+ * queued output and I/O state go with it.
+ */
+void move_player(struct client **new_player_list, struct client *player,
+                 struct game_state *game, struct game_events *ev) {
   struct client **curr_p;
-  for (curr_p = new_player_list; *curr_p && (*curr_p)->fd != dp_fd;
+  for (curr_p = new_player_list; *curr_p && *curr_p != player;
        curr_p = &(*curr_p)->next)
       ;
-  if (*curr_p) {
-    struct client *t = (*curr_p)->next;
-    printf("Removing client %d %s\n", dp_fd, inet_ntoa((*curr_p)->ipaddr));
-    FD_CLR(p->fd, &allset);
-    close((*curr_p)->fd);
-    free(*curr_p);
-    *curr_p = t;
+  if (*curr_p == NULL) {
+    fprintf(stderr, "Trying to move fd %d, but I don't know about it\n",
+            player->fd);
+    return;
+  }
+  *curr_p = player->next;
+  game_join(game, player, ev);
+  printf("[%d] Joined room %d as %s\n", player->fd, game->id, player->name);
+}
+
+/*
+ * Move a player from the new_player_list to the active game list.
+ */
+struct client *search(int fd, struct game_state *game) {
+  struct client *p;
+  for (p = game->head; p != NULL; p = p->next) {
+    if (p->fd == fd) {
+      return p;
+    }
+  }
+  return p;
+}
+
+/*
+ * Broadcast outbuf to everyone in the game.
+ */
+void broadcast(struct game_state *game, char *outbuf) {
+    // Render the message once and share it between every player's queue.
+    struct message *m = new_message(outbuf);
+    struct client *p;
+    for (p = game->head; p != NULL; p = p->next) {
+        queue_message(p, m);
+    }
+    for (p = game->spectators; p != NULL; p = p->next) {
+        queue_message(p, m);
+    }
+    release_message(m);
+}
+
+/*
+ * Queue msg to be sent to p at the end of this pass through the event loop.
+ */
+void send_message(struct client *p, char *msg) {
+    if (p->fd < 0 || p->dead) {
+        return;
+    }
+    struct message *m = new_message(msg);
+    queue_message(p, m);
+    release_message(m);
+}
+
+/*
+ * Queue m to be sent to p, taking a reference to it. Nothing is queued for
+ * a client that has disconnected, or for a bot, which has no socket to
+ * flush its queue to. A client that has stopped reading and fallen
+ * OUTQUEUE_MAX messages behind is disconnected instead; it is usually a
+ * spectator.
+ */
+void queue_message(struct client *p, struct message *m) {
+    if (p->fd < 0 || p->dead) {
+        return;
+    }
+    if (p->out.count >= OUTQUEUE_MAX) {
+        printf("[%d] Too far behind on its output; dropping it\n", p->fd);
+        disconnect_client(p);
+        return;
+    }
+    if (!p->pending) {
+        if (npending == pending_cap) {
+            pending_cap = pending_cap < 64 ? 64 : pending_cap * 2;
+            pending = mem_realloc(MEM_CLIENTS, pending,
+                                  pending_cap * sizeof(struct client *));
+            if (pending == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        pending[npending++] = p;
+        p->pending = 1;
+    }
+    enqueue_message(&p->out, m);
+}
+
+/*
+ * Take off the list of clients with output waiting every client whose
+ * queue is empty or that has been disconnected.
+ */
+void prune_pending() {
+    int kept = 0;
+    for (int i = 0; i < npending; i++) {
+        struct client *p = pending[i];
+        if (!p->dead && p->out.count > 0) {
+            pending[kept++] = p;
+        }
+        else {
+            p->pending = 0;
+        }
+    }
+    npending = kept;
+}
+
+/*
+ * Release everything owned by p and free it. The caller is responsible for
+ * unlinking p from its list first.
+ */
+void free_client(struct client *p) {
+    if (p->fd >= 0) {
+        ratelimit_release(p->ipaddr);
+        set_fd_client(p->fd, NULL);
+        connected_clients--;
+        if (cluster_fd != -1) {
+            cluster_closed_add(p->ipaddr);
+        }
+    }
+    pollset_stale = 1;
+    clear_queue(&p->out);
+    if (p->inbuf != NULL) {
+        pool_put(&inbuf_pool, p->inbuf);
+    }
+    pool_put(&client_pool, p);
+}
+
+/*
+ * Note that p is the client on socket descriptor fd, or with p NULL that
+ * fd no longer has one.
+ */
+void set_fd_client(int fd, struct client *p) {
+    if (fd >= fd_clients_cap) {
+        int cap = (fd + 1) * 2;
+        fd_clients = mem_realloc(MEM_CLIENTS, fd_clients,
+                                 cap * sizeof(struct client *));
+        if (fd_clients == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        for (int i = fd_clients_cap; i < cap; i++) {
+            fd_clients[i] = NULL;
+        }
+        fd_clients_cap = cap;
+    }
+    fd_clients[fd] = p;
+}
+
+/*
+ * Return the client on socket descriptor fd, or NULL if it has none.
+ */
+struct client *fd_client(int fd) {
+    return fd >= 0 && fd < fd_clients_cap ? fd_clients[fd] : NULL;
+}
+
+/*
+ * Return the client after p in a walk over every client on the server: the
+ * new players, then the players and the spectators of each room in turn.
+ * Start the walk with p NULL; it ends when NULL is returned. Nothing may be
+ * unlinked while a walk is under way.
+ */
+struct client *next_client(struct client *new_players, struct client *p) {
+  int r;
+  if (p == NULL) {
+    if (new_players != NULL) {
+      return new_players;
+    }
+    r = 0;
+  }
+  else if (p->next != NULL) {
+    return p->next;
+  }
+  else if (p->room == NULL) {
+    r = 0;
+  }
+  else if (!p->watching && p->room->spectators != NULL) {
+    return p->room->spectators;
   }
   else {
-    fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
-    dp_fd);
+    r = p->room->slot + 1;
+  }
+  for (; r < lobby.nrooms; r++) {
+    if (lobby.rooms[r]->head != NULL) {
+      return lobby.rooms[r]->head;
+    }
+    if (lobby.rooms[r]->spectators != NULL) {
+      return lobby.rooms[r]->spectators;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Write out everything queued for the clients with output waiting, so that
+ * each client receives at most one writev per tick. Output a client's socket buffer
+ * cannot take stays queued until poll says the socket is writable again.
+ * A client whose write fails is only marked as disconnected, so the walk
+ * is never disturbed; reap_clients removes it afterwards.
+ */
+void flush_clients() {
+  for (int i = 0; i < npending; i++) {
+    struct client *p = pending[i];
+    if (!p->dead && flush_queue(p->fd, &p->out) == -1) {
+      fprintf(stderr, "Write to client failed\n");
+      disconnect_client(p);
+    }
+  }
+  prune_pending();
+}
+
+/*
+ * Write out what is queued for p without waiting, in order, for a client
+ * about to be disconnected, since disconnect_client drops whatever is
+ * still queued. Under io_uring the send goes on the ring, which
+ * reap_clients submits ahead of the cancel for p's socket.
+ */
+void flush_client(struct client *p) {
+  if (p->dead || p->fd < 0) {
+    return;
+  }
+  if (p->io != NULL) {
+    uring_flush_client(p);
+  }
+  else if (flush_queue(p->fd, &p->out) == -1) {
+    fprintf(stderr, "Write to client failed\n");
+  }
+}
+
+/*
+ * Mark p as disconnected. It gets no more output and its input is ignored
+ * from now on, but it stays in its list (so that nobody walking the list
+ * is disturbed) until reap_clients removes it at the end of the pass
+ * through the event loop.
+ */
+void disconnect_client(struct client *p) {
+  if (!p->dead) {
+    p->dead = 1;
+    clear_queue(&p->out);
+    dead_clients++;
+    // The name is free for someone else right away.
+    if (p->name[0] != '\0') {
+      names_release(p->name);
+    }
+  }
+}
+
+/*
+ * Unlink every disconnected client in the list top onto graveyard.
+ * Return the number of clients moved.
+ */
+int reap_list(struct client **top, struct client **graveyard) {
+  int reaped = 0;
+  struct client **curr_p = top;
+  while (*curr_p) {
+    struct client *p = *curr_p;
+    if (p->dead) {
+      *curr_p = p->next;
+      p->next = *graveyard;
+      *graveyard = p;
+      reaped++;
+    }
+    else {
+      curr_p = &p->next;
+    }
+  }
+  return reaped;
+}
+
+/*
+ * Remove every client marked as disconnected in one batch. In each room
+ * that players left, the rest are told who left and then whose turn it
+ * is, once for the whole batch; rooms left empty are retired. Return the
+ * number of clients removed.
+ */
+int reap_clients(struct client **new_player_list) {
+  struct game_events ev;
+  struct client *gone_players = NULL;
+  struct client *graveyard = NULL;
+  struct client *p, *next;
+
+  if (dead_clients == 0) {
+    return 0;
+  }
+  dead_clients = 0;
+  // Nobody about to be freed may be left on the list.
+  prune_pending();
+
+  // Players waiting for a seat are still in the new player list.
+  int still_waiting = 0;
+  for (int i = 0; i < lobby.nwaiting; i++) {
+    if (!lobby.waiting[i]->dead) {
+      lobby.waiting[still_waiting++] = lobby.waiting[i];
+    }
+  }
+  lobby.nwaiting = still_waiting;
+
+  int reaped = reap_list(new_player_list, &graveyard);
+  for (int r = 0; r < lobby.nrooms; r++) {
+    struct game_state *game = lobby.rooms[r];
+    // The client is about to go back to the pool, where the next client
+    // could be handed the same address.
+    if (game->clock_holder != NULL && game->clock_holder->dead) {
+      game->clock_holder = NULL;
+      timer_stop(&game->turn_clock);
+    }
+    // The game engine hands the turn on from a holder who leaves.
+    game->departed = 0;
+    for (p = game->head; p != NULL; p = next) {
+      next = p->next;
+      if (p->dead) {
+        ev.n = 0;
+        game_leave(game, p, &ev);
+        play_events(game, &ev);
+        p->next = gone_players;
+        gone_players = p;
+        game->departed++;
+      }
+    }
+    reaped += game->departed;
+    reaped += reap_list(&(game->spectators), &graveyard);
+  }
+
+  // Cancel the io_uring requests of the whole batch with one submission;
+  // it has to reach the kernel before the descriptors are closed.
+  struct client *lists[2] = {gone_players, graveyard};
+  if (ring != NULL) {
+    for (int i = 0; i < 2; i++) {
+      for (p = lists[i]; p != NULL; p = p->next) {
+        if (p->io != NULL) {
+          uring_forget(p);
+        }
+      }
+    }
+    uring_submit_and_wait(ring, 0);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    for (p = lists[i]; p != NULL; p = next) {
+      next = p->next;
+      printf("Removing client %d %s\n", p->fd, inet_ntoa(p->ipaddr));
+      if (i == 0) {
+        struct game_state *game = p->room;
+        if (p->fd >= 0) {
+          game->seated--;
+          lobby.players--;
+          lobby_update(&lobby, game);
+          checkpoint.dirty = 1;
+        }
+      }
+      if (p->fd >= 0) {
+        close(p->fd);
+      }
+      free_client(p);
+    }
+  }
+
+  // Retiring a room moves the last room into its slot, so go backwards.
+  // A room is kept while seats in it are held for players from a
+  // checkpoint.
+  for (int r = lobby.nrooms - 1; r >= 0; r--) {
+    struct game_state *game = lobby.rooms[r];
+    if (game->head == NULL && game->spectators == NULL &&
+        game->reserved == 0) {
+      retire_room(game);
+    }
+    else if (game->departed > 0 && game->head != NULL) {
+      announce_turn(game);
+    }
+  }
+  return reaped;
+}
+
+/*
+ * End a pass through the event loop: seat the players who chose a name,
+ * skip the turns that ran out, reap the clients that disconnected during
+ * it and write out everything queued. Writes that fail disconnect more
+ * clients, so repeat until none are left to reap. A cluster backend then
+ * reports its load, and a checkpoint is taken if one is due.
+ */
+void finish_tick(struct client **new_player_list) {
+  seat_waiting_players(new_player_list);
+  expire_turns();
+  tend_bots(new_player_list);
+  do {
+    reap_clients(new_player_list);
+    flush_clients();
+  } while (dead_clients > 0);
+  cluster_report();
+  tend_checkpoint();
+}
+
+/*
+ * Count the players and spectators who have not disconnected.
+ */
+int count_room(struct game_state *game) {
+  struct client *p;
+  int n = count_players(game);
+  for (p = game->spectators; p != NULL; p = p->next) {
+    if (!p->dead) {
+      n++;
+    }
+  }
+  return n;
+}
+
+/*
+ * Detach the trace of the pass through the event loop that is ending.
+ * Return it, or NULL if tracing is off or the pass had nothing to trace.
+ */
+struct trace_tick *end_traced_tick() {
+  if (!tracing) {
+    return NULL;
+  }
+  return trace_end_tick();
+}
+
+/*
+ * Print how much of each pool is in use to stderr.
+ */
+void dump_pools() {
+  pool_dump(stderr, "clients", &client_pool);
+  pool_dump(stderr, "inbufs", &inbuf_pool);
+  pool_dump(stderr, "uring", &conn_pool);
+}
+
+/*
+ * Dump the memory counters and the latency histograms to stderr if SIGUSR1
+ * has asked for them since the last check.
+ */
+void check_dump() {
+  if (trace_dump_requested) {
+    trace_dump_requested = 0;
+    mem_dump(stderr);
+    dump_pools();
+    fprintf(stderr, "games finished %ld, turns skipped %ld, "
+            "players removed %ld\n", games_finished, turns_skipped,
+            players_kicked);
+    trace_dump(stderr);
+  }
+}
+
+/*
+ * Let go of the held seats if the grace period is over, and take a
+ * checkpoint if one is due.
+ */
+void tend_checkpoint() {
+  if (checkpoint.held != NULL && ratelimit_clock >= checkpoint.held_until) {
+    expire_reservations();
+  }
+  if (checkpoint.path != NULL) {
+    checkpoint_tick(&lobby);
+  }
+}
+
+/*
+ * Return the ratelimit_clock time by which the event loop has to wake up
+ * even if no client does anything, or -1 if it can wait indefinitely.
+ */
+long next_deadline() {
+  long deadline = checkpoint_deadline();
+  long turn = timer_next(&turn_timers);
+  if (deadline == -1 || (turn != -1 && turn < deadline)) {
+    deadline = turn;
+  }
+  return deadline;
+}
+
+/*
+ * Start the turn clock of game for the player who has the turn, unless it
+ * is already running for them. Turns are only timed with -D.
+ */
+void start_turn_clock(struct game_state *game) {
+  if (turn_deadline > 0 && game->has_next_turn != game->clock_holder) {
+    game->clock_holder = game->has_next_turn;
+    timer_start(&turn_timers, &game->turn_clock);
+  }
+}
+
+/*
+ * Take the turn away from the player in game whose time ran out. With -G
+ * the room loses a guess for it, and a player who has now missed
+ * kick_after turns in a row is removed instead of being passed over.
+ */
+void skip_turn(struct game_state *game) {
+  struct game_events ev;
+  char msg[MAX_MSG];
+  struct client *p = game->clock_holder;
+  game->clock_holder = NULL;
+  if (p == NULL || p->dead || p != game->has_next_turn) {
+    return;
+  }
+  turns_skipped++;
+  p->missed++;
+  printf("%s ran out of time.\n", p->name);
+  sprintf(msg, "%s ran out of time.\r\n", p->name);
+  broadcast(game, msg);
+
+  if (kick_after > 0 && p->missed >= kick_after) {
+    players_kicked++;
+    printf("Removing %s after %d missed turns\n", p->name, p->missed);
+    // The goodbye goes out behind everything already queued for p, which
+    // is written now, as a disconnected client's queue is dropped.
+    send_message(p, "You have been removed for missing too many turns.\r\n");
+    flush_client(p);
+    disconnect_client(p);
+    return;
+  }
+  if (turn_costs_guess) {
+    checkpoint.dirty = 1;
+  }
+  ev.n = 0;
+  game_skip(game, turn_costs_guess, &ev);
+  play_events(game, &ev);
+}
+
+/*
+ * Skip the turn in each room whose turn clock has run out. The clocks fire
+ * in the order they were started, so this stops at the first one that has
+ * not.
+ */
+void expire_turns() {
+  struct timer *t;
+  while ((t = timer_expired(&turn_timers)) != NULL) {
+    skip_turn((struct game_state *)((char *)t -
+                                    offsetof(struct game_state, turn_clock)));
+  }
+}
+
+/*
+ * Return how long poll may wait, in milliseconds: not at all while a bot
+ * has a guess to make, otherwise until the next deadline if there is one.
+ */
+int poll_timeout() {
+  if (bots_have_turn()) {
+    return 0;
+  }
+  long deadline = next_deadline();
+  if (deadline == -1) {
+    return -1;
+  }
+  if (deadline <= ratelimit_clock) {
+    return 0;
+  }
+  return (deadline - ratelimit_clock + 999) / 1000;
+}
+
+/*
+ * Open a room with a fresh game and add it to the lobby.
+ */
+struct game_state *open_room() {
+  struct game_state *room = mem_malloc(MEM_ROOMS, sizeof(struct game_state));
+  if (room == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  room->dict = lobby.dict;
+  new_game(room);
+  room->head = NULL;
+  room->has_next_turn = NULL;
+  room->spectators = NULL;
+  room->seated = 0;
+  room->reserved = 0;
+  room->departed = 0;
+  timer_init(&room->turn_clock);
+  room->clock_holder = NULL;
+  lobby_add_room(&lobby, room);
+  printf("Opened room %d (%d open)\n", room->id, lobby.nrooms);
+  return room;
+}
+
+/*
+ * Take room out of the lobby and free it. Nobody may be left in it.
+ */
+void retire_room(struct game_state *room) {
+  printf("Retired room %d (%d open)\n", room->id, lobby.nrooms - 1);
+  lobby_remove_room(&lobby, room);
+  timer_stop(&room->turn_clock);
+  mem_free(room);
+  checkpoint.dirty = 1;
+}
+
+/*
+ * Seat p in room: announce them to the room, show them the gameboard and
+ * tell everyone whose turn it is.
+ */
+void seat_player(struct client **new_player_list, struct client *p,
+                 struct game_state *room) {
+  struct game_events ev;
+
+  ev.n = 0;
+  move_player(new_player_list, p, room, &ev);
+  room->seated++;
+  lobby.players++;
+  checkpoint.dirty = 1;
+  game_turn(room, &ev);
+  play_events(room, &ev);
+}
+
+/*
+ * Seat the players who chose a name during this pass, in the order they
+ * chose it. Players go to the room at the top of the lobby's queue until
+ * it is full, and a room is only opened once every room is full, so a
+ * batch costs one queue update per room it touches rather than one per
+ * player.
+ */
+void seat_waiting_players(struct client **new_player_list) {
+  int i = 0;
+  while (i < lobby.nwaiting) {
+    struct game_state *room = lobby_best_room(&lobby);
+    if (room == NULL) {
+      room = open_room();
+    }
+    for (; i < lobby.nwaiting && room->seated + room->reserved < lobby.seats;
+         i++) {
+      struct client *p = lobby.waiting[i];
+      // Someone who left before being seated is reaped from the new
+      // player list instead.
+      if (!p->dead) {
+        seat_player(new_player_list, p, room);
+      }
+    }
+    lobby_update(&lobby, room);
+  }
+  lobby.nwaiting = 0;
+}
+
+/*
+ * Move a new player onto the spectator list of the room with the most
+ * players. Spectators receive everything that is broadcast in their room
+ * but never take a turn.
+ */
+void make_spectator(struct client **new_player_list, struct client *p) {
+  char game_display[MAX_MSG];
+  char turn[MAX_MSG];
+
+  struct client **curr_p;
+  for (curr_p = new_player_list; *curr_p && *curr_p != p;
+       curr_p = &(*curr_p)->next)
+      ;
+  if (*curr_p == NULL) {
+    fprintf(stderr, "Trying to move fd %d, but I don't know about it\n",
+            p->fd);
+    return;
+  }
+  struct game_state *game = NULL;
+  for (int r = 0; r < lobby.nrooms; r++) {
+    if (game == NULL || lobby.rooms[r]->seated > game->seated) {
+      game = lobby.rooms[r];
+    }
+  }
+  if (game == NULL) {
+    game = open_room();
+  }
+  *curr_p = p->next;
+  p->next = game->spectators;
+  game->spectators = p;
+  p->room = game;
+  p->watching = 1;
+  printf("[%d] Now spectating room %d\n", p->fd, game->id);
+
+  send_message(p, status_message(game_display, game));
+  if (game->has_next_turn != NULL) {
+    sprintf(turn, "It's %s's turn.\r\n", game->has_next_turn->name);
+    send_message(p, turn);
+  }
+}
+
+/*
+ * Reopen every room of the snapshot at checkpoint.path with its word and
+ * guesses as they were, and hold each player's seat for CHECKPOINT_GRACE so
+ * that they can come back to it by entering the same name. Rooms that had
+ * no players are not reopened.
+ */
+void restore_checkpoint() {
+  struct checkpoint_room *rooms;
+  char (*names)[MAX_NAME];
+  int nrooms = checkpoint_load(&rooms, &names, lobby.dict.size);
+  if (nrooms == -1) {
+    return;
+  }
+
+  ratelimit_tick();
+  int n = 0;
+  for (int r = 0; r < nrooms; r++) {
+    if (rooms[r].players == 0) {
+      continue;
+    }
+    struct game_state *game = open_room();
+    strcpy(game->word, rooms[r].word);
+    strcpy(game->guess, rooms[r].guess);
+    memcpy(game->letters_guessed, rooms[r].letters_guessed,
+           sizeof(game->letters_guessed));
+    game->guesses_left = rooms[r].guesses_left;
+    for (int i = 0; i < rooms[r].players; i++) {
+      checkpoint_hold(names[n++], game);
+      game->reserved++;
+    }
+    lobby_update(&lobby, game);
+  }
+  mem_free(rooms);
+  mem_free(names);
+  printf("Holding %d seats in %d rooms for %lds\n", checkpoint.nheld,
+         lobby.nrooms, CHECKPOINT_GRACE / 1000000);
+}
+
+/*
+ * If a seat from a checkpoint is held for p's name, seat p in it: in the
+ * room they were in, and after the nearest player ahead of them in the old
+ * turn order who is already back. The first player back in a room has the
+ * turn. Return 1 if p was seated and 0 if no seat was held for them.
+ */
+int reclaim_seat(struct client **new_player_list, struct client *p) {
+  struct reservation *seat = checkpoint_claim(p->name);
+  if (seat == NULL) {
+    return 0;
+  }
+  struct game_state *room = seat->room;
+  struct client *ahead = NULL;
+  for (int i = seat - checkpoint.held - 1;
+       i >= 0 && checkpoint.held[i].room == room && ahead == NULL; i--) {
+    struct client *q = names_lookup(checkpoint.held[i].name);
+    if (checkpoint.held[i].claimed && q != NULL && q->room == room &&
+        !q->watching) {
+      ahead = q;
+    }
+  }
+
+  room->reserved--;
+  seat_player(new_player_list, p, room);
+  // seat_player puts p at the head of the list.
+  if (ahead != NULL) {
+    room->head = p->next;
+    p->next = ahead->next;
+    ahead->next = p;
+  }
+  lobby_update(&lobby, room);
+  printf("[%d] Reclaimed a seat in room %d\n", p->fd, room->id);
+  return 1;
+}
+
+/*
+ * Let go of every held seat once the grace period is over, so that new
+ * players can have them, and retire the rooms nobody came back to.
+ */
+void expire_reservations() {
+  int unclaimed = 0;
+  for (int i = 0; i < checkpoint.nheld; i++) {
+    if (!checkpoint.held[i].claimed) {
+      checkpoint.held[i].room->reserved--;
+      unclaimed++;
+    }
+  }
+  checkpoint_release();
+  printf("Let go of %d seats nobody came back for\n", unclaimed);
+
+  for (int r = lobby.nrooms - 1; r >= 0; r--) {
+    struct game_state *game = lobby.rooms[r];
+    if (game->head == NULL && game->spectators == NULL) {
+      retire_room(game);
+    }
+    else {
+      lobby_update(&lobby, game);
+    }
+  }
+  checkpoint.dirty = 1;
+}
+
+/*
+ * Fill pollset with listenfd, upgrade_fd and cluster_fd, every client if
+ * that has changed, and the clients with output waiting, growing it as
+ * needed. Return the number of entries.
+ */
+int build_pollset(int listenfd, struct client *new_players) {
+  int n = pollset_clients;
+  struct client *p;
+
+  if (pollset_stale) {
+    n = POLL_FIRST_CLIENT;
+    for (p = next_client(new_players, NULL); p != NULL;
+         p = next_client(new_players, p)) {
+      n++;
+    }
+  }
+  if (n + npending > pollset_cap) {
+    pollset_cap = (n + npending) * 2;
+    pollset = mem_realloc(MEM_BUFFERS, pollset,
+                          pollset_cap * sizeof(struct pollfd));
+    if (pollset == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  pollset[0].fd = listenfd;
+  pollset[0].events = POLLIN;
+  // poll skips entries with a negative descriptor, so this slot is simply
+  // ignored when upgrades are not enabled.
+  pollset[1].fd = upgrade_fd;
+  pollset[1].events = POLLIN;
+  pollset[2].fd = cluster_fd;
+  pollset[2].events = POLLIN;
+  if (pollset_stale) {
+    n = POLL_FIRST_CLIENT;
+    for (p = next_client(new_players, NULL); p != NULL;
+         p = next_client(new_players, p)) {
+      pollset[n].fd = p->fd;
+      pollset[n].events = POLLIN;
+      n++;
+    }
+    pollset_clients = n;
+    pollset_stale = 0;
+  }
+  for (int i = 0; i < npending; i++) {
+    pollset[n].fd = pending[i]->fd;
+    pollset[n].events = POLLOUT;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Close p's socket descriptor, first cancelling anything the io_uring
+ * backend still has in flight on it.
+ */
+void close_client(struct client *p) {
+  if (ring != NULL && p->io != NULL) {
+    uring_forget(p);
+    uring_submit_and_wait(ring, 0);
+  }
+  if (p->fd >= 0) {
+    close(p->fd);
+  }
+}
+
+/*
+ * Apply the per-address limits to the newly accepted client clientfd, so
+ * that one address cannot tie up the server with connections. A refused
+ * client is told why and closed before it costs a struct client.
+ * Return 1 if the client may stay and 0 if it was refused.
+ */
+int admit_connection(int clientfd, struct in_addr addr) {
+  char *refused_msg = "Too many connections from your address. "
+                      "Try again later.\r\n";
+  if (ratelimit_connect(addr) == 0) {
+    return 1;
+  }
+  printf("Refusing connection from %s (%ld refused)\n", inet_ntoa(addr),
+         rate_stats.refused_connections);
+  send(clientfd, refused_msg, strlen(refused_msg), MSG_DONTWAIT);
+  close(clientfd);
+  return 0;
+}
+
+/*
+ * Take a token from p's line bucket. A client sending lines faster than
+ * LINE_RATE has the excess dropped without being handled.
+ * Return 1 if the line should be handled and 0 if it was dropped.
+ */
+int line_allowed(struct client *p) {
+  if (ratelimit_line(&p->lines)) {
+    return 1;
+  }
+  printf("[%d] Too many lines; dropped one (%ld dropped)\n", p->fd,
+         rate_stats.dropped_lines);
+  return 0;
+}
+
+/*
+ * Add the newly accepted client clientfd to the new player list and greet
+ * it. Return the new client.
+ */
+struct client *new_connection(int clientfd, struct in_addr addr,
+                              struct client **new_player_list) {
+  printf("Connection from %s\n", inet_ntoa(addr));
+  if (recording != NULL) {
+    record_connect(clientfd);
+  }
+  add_player(new_player_list, clientfd, addr);
+  char *greeting = WELCOME_MSG;
+  send_message(*new_player_list, greeting);
+  return *new_player_list;
+}
+
+/*
+ * The default event loop: wait for input with poll, read it, and flush
+ * everything that handling it produced.
+ */
+void run_poll_loop(int listenfd, struct client **new_player_list) {
+  char buf[MAX_BUF];
+
+  while (1) {
+    check_dump();
+    // listenfd is always the first entry in pollset
+    int nfds = build_pollset(listenfd, *new_player_list);
+    // A bot holding the turn still has guessing to do.
+    int nready = poll(pollset, nfds, poll_timeout());
+    if (nready == -1) {
+      if (errno != EINTR) {
+        perror("poll");
+      }
+      continue;
+    }
+    ratelimit_tick();
+    trace_begin_tick();
+
+    if (pollset[0].revents & POLLIN) {
+      printf("A new client is connecting\n");
+      struct in_addr addr;
+      int clientfd = accept_connection(listenfd, &addr);
+      if (clientfd != -1 && admit_connection(clientfd, addr)) {
+        new_connection(clientfd, addr, new_player_list);
+      }
+    }
+    if (pollset[1].revents & POLLIN) {
+      start_upgrade(listenfd, new_player_list);
+    }
+    if (pollset[2].revents & (POLLIN | POLLHUP)) {
+      receive_cluster_client(new_player_list);
+    }
+
+    /* Check which other socket descriptors have something ready to read.
+     * Clients are only unlinked and freed at the end of the pass, so the
+     * client on each descriptor is still there to be handed its input.
+     */
+    for (int i = POLL_FIRST_CLIENT; i < pollset_clients; i++) {
+      struct client *p = fd_client(pollset[i].fd);
+      if ((pollset[i].revents & (POLLIN | POLLHUP | POLLERR)) && p != NULL) {
+        int len = read(pollset[i].fd, buf, sizeof(buf));
+        if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+          continue;
+        }
+        handle_input(p, buf, len, new_player_list);
+      }
+    }
+
+    // Everything produced during this pass goes out in one write per
+    // client.
+    finish_tick(new_player_list);
+    trace_complete(end_traced_tick());
+    if (recording != NULL) {
+      record_flush();
+    }
+  }
+}
+
+/*
+ * Feed the recording in fp through the game as fast as possible and report
+ * how long it took, so that builds can be compared on identical traffic.
+ * Every recorded client writes to /dev/null instead of a socket; each event
+ * is handled as its own pass through the event loop.
+ */
+void run_replay(FILE *fp, struct client **new_player_list) {
+  struct event *e = mem_malloc(MEM_BUFFERS, sizeof(struct event));
+  // Maps socket descriptors in the recording to the ones used here.
+  int *fds = NULL;
+  int fds_cap = 0;
+  struct in_addr addr;
+  addr.s_addr = htonl(INADDR_LOOPBACK);
+  long events = 0;
+  long total_ns = 0, max_ns = 0;
+  struct timespec before, after;
+
+  if (e == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  while (replay_next(fp, e)) {
+    if (e->fd >= fds_cap) {
+      int cap = (e->fd + 1) * 2;
+      fds = mem_realloc(MEM_BUFFERS, fds, cap * sizeof(int));
+      if (fds == NULL) {
+        perror("realloc");
+        exit(1);
+      }
+      for (int i = fds_cap; i < cap; i++) {
+        fds[i] = -1;
+      }
+      fds_cap = cap;
+    }
+    if (e->type != EVENT_CONNECT && fds[e->fd] == -1) {
+      fprintf(stderr, "Recording uses fd %d before connecting it\n", e->fd);
+      continue;
+    }
+
+    // A turn that ran out before this event woke the live server for a
+    // pass with no input in it, which skipped the turn in finish_tick.
+    long turn;
+    while ((turn = timer_next(&turn_timers)) != -1 && turn <= e->usec) {
+      ratelimit_clock = turn;
+      finish_tick(new_player_list);
+    }
+    // Rate limits are applied on the recording's clock, as they were when
+    // it was recorded.
+    ratelimit_clock = e->usec;
+    trace_begin_tick();
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    if (e->type == EVENT_CONNECT) {
+      fds[e->fd] = open("/dev/null", O_WRONLY);
+      if (fds[e->fd] == -1) {
+        perror("open");
+        exit(1);
+      }
+      new_connection(fds[e->fd], addr, new_player_list);
+    }
+    else if (fd_client(fds[e->fd]) == NULL) {
+      // The server already removed the client.
+      fds[e->fd] = -1;
+    }
+    else if (e->type == EVENT_INPUT) {
+      handle_input(fd_client(fds[e->fd]), e->data, e->len, new_player_list);
+    }
+    else {
+      handle_input(fd_client(fds[e->fd]), NULL, 0, new_player_list);
+      fds[e->fd] = -1;
+    }
+    finish_tick(new_player_list);
+    trace_complete(end_traced_tick());
+    clock_gettime(CLOCK_MONOTONIC, &after);
+
+    long ns = (after.tv_sec - before.tv_sec) * 1000000000L
+              + (after.tv_nsec - before.tv_nsec);
+    total_ns += ns;
+    if (ns > max_ns) {
+      max_ns = ns;
+    }
+    events++;
+  }
+
+  fprintf(stderr, "Replayed %ld events in %.3f s (%.0f events/s); "
+          "%.1f us mean, %.1f us max per event\n",
+          events, total_ns / 1e9,
+          total_ns > 0 ? events / (total_ns / 1e9) : 0.0,
+          events > 0 ? total_ns / 1e3 / events : 0.0, max_ns / 1e3);
+  if (tracing) {
+    trace_dump(stderr);
+  }
+  mem_dump(stderr);
+  dump_pools();
+  mem_free(fds);
+  mem_free(e);
+  fclose(fp);
+}
+
+/* Tags kept in the low bits of an io_uring request's user_data. The rest
+ * of user_data points at the uring_conn or uring_send the request belongs
+ * to, both of which are at least 8-byte aligned.
+ */
+#define URING_ACCEPT 1
+#define URING_RECV 2
+#define URING_SEND 3
+#define URING_CANCEL 4
+#define URING_UPGRADE 5
+#define URING_CLUSTER 6
+#define URING_TIMER 7
+#define URING_TAG_MASK 7UL
+
+/* The most messages written by one io_uring send. */
+#define URING_MAX_IOV 64
+
+/* The number of io_uring requests in flight, not counting cancels. */
+int uring_pending = 0;
+/* Set while an upgrade drains the ring; nothing new is armed. */
+int uring_quiescing = 0;
+/* The deadline of the earliest timeout in flight, or -1 if none is. Timeouts
+ * are not counted in uring_pending: one still in flight when the server
+ * hands over simply goes with the ring.
+ */
+long uring_timer = -1;
+struct __kernel_timespec uring_timeout;
+
+/* io_uring state for one connection. The client points to it through its
+ * io field; it is freed once the client is gone and no request in flight
+ * refers to it any more.
+ */
+struct uring_conn {
+  struct client *client;  // Only while the connection is not dead
+  int fd;
+  int dead;      // The client has been closed
+  int refs;      // One for the client and one per request in flight
+  int sending;   // A send is in flight, so later output has to wait
+};
+struct pool conn_pool = POOL_INIT(sizeof(struct uring_conn), 256, MEM_CLIENTS);
+
+/* The trace of the pass whose sends uring_flush_client is queueing. */
+struct trace_tick *trace_sending = NULL;
+
+/* A sendmsg in flight and the messages it is writing, which must stay
+ * alive until the kernel is done with them.
+ */
+struct uring_send {
+  struct uring_conn *conn;
+  struct msghdr msg;
+  int len;
+  int count;
+  struct trace_tick *trace;  // Completed when its last send is
+  struct message *msgs[URING_MAX_IOV];
+  struct iovec iov[URING_MAX_IOV];
+};
+
+/*
+ * Drop a reference to conn.
+ */
+void uring_put_conn(struct uring_conn *conn) {
+  if (--conn->refs == 0) {
+    pool_put(&conn_pool, conn);
+  }
+}
+
+/*
+ * Queue a multishot accept on listenfd.
+ */
+void uring_arm_accept(int listenfd) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_ACCEPT;
+  uring_pending++;
+}
+
+/*
+ * Queue a poll for a new server binary connecting to upgrade_fd.
+ */
+void uring_arm_upgrade() {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = upgrade_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_UPGRADE;
+  uring_pending++;
+}
+
+/*
+ * Queue a poll for the cluster coordinator sending a client on cluster_fd.
+ */
+void uring_arm_cluster() {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = cluster_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = URING_CLUSTER;
+  uring_pending++;
+}
+
+/*
+ * Queue a timeout that wakes the ring at deadline (on ratelimit_clock),
+ * unless one is already in flight that wakes it no later. A deadline of -1
+ * needs no timeout.
+ */
+void uring_arm_timer(long deadline) {
+  if (deadline == -1 || (uring_timer != -1 && uring_timer <= deadline)) {
+    return;
+  }
+  long usec = deadline > ratelimit_clock ? deadline - ratelimit_clock : 0;
+  uring_timeout.tv_sec = usec / 1000000;
+  uring_timeout.tv_nsec = usec % 1000000 * 1000;
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long)&uring_timeout;
+  sqe->len = 1;
+  sqe->user_data = URING_TIMER;
+  uring_timer = deadline;
+}
+
+/*
+ * Queue a multishot receive on conn that picks its buffers from the
+ * provided buffer ring.
+ */
+void uring_arm_recv(struct uring_conn *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = (unsigned long)conn | URING_RECV;
+  conn->refs++;
+  uring_pending++;
+}
+
+/*
+ * Attach io_uring state to p and start receiving from it.
+ */
+void uring_attach(struct client *p) {
+  struct uring_conn *conn = pool_get(&conn_pool);
+  conn->client = p;
+  conn->fd = p->fd;
+  conn->dead = 0;
+  conn->refs = 1;
+  conn->sending = 0;
+  p->io = conn;
+  uring_arm_recv(conn);
+}
+
+/*
+ * Detach p from its io_uring state and queue a cancel of every request on
+ * its socket. The caller must submit the cancel before closing the
+ * descriptor, or the next accept could reuse it and be cancelled instead.
+ */
+void uring_forget(struct client *p) {
+  struct uring_conn *conn = p->io;
+  conn->dead = 1;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = conn->fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = URING_CANCEL;
+
+  p->io = NULL;
+  uring_put_conn(conn);
+}
+
+/*
+ * Queue one sendmsg holding everything waiting in p's queue (up to
+ * URING_MAX_IOV messages). A client has at most one send in flight so
+ * that its messages cannot be reordered.
+ */
+void uring_flush_client(struct client *p) {
+  struct uring_conn *conn = p->io;
+  if (p->out.count == 0 || conn->sending) {
+    return;
+  }
+
+  struct uring_send *send = mem_malloc(MEM_BUFFERS, sizeof(struct uring_send));
+  if (send == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  int n = p->out.count < URING_MAX_IOV ? p->out.count : URING_MAX_IOV;
+  send->conn = conn;
+  send->count = n;
+  send->len = 0;
+  send->trace = trace_sending;
+  if (trace_sending != NULL) {
+    trace_sending->sends++;
+  }
+  for (int i = 0; i < n; i++) {
+    // The queue's references move to the send.
+    send->msgs[i] = p->out.msgs[i];
+    send->iov[i].iov_base = send->msgs[i]->text;
+    send->iov[i].iov_len = send->msgs[i]->len;
+    send->len += send->msgs[i]->len;
+  }
+  // Skip whatever a write before the switch to io_uring already sent.
+  send->iov[0].iov_base = (char *)send->iov[0].iov_base + p->out.sent;
+  send->iov[0].iov_len -= p->out.sent;
+  send->len -= p->out.sent;
+  p->out.sent = 0;
+  memmove(p->out.msgs, p->out.msgs + n,
+          (p->out.count - n) * sizeof(struct message *));
+  p->out.count -= n;
+  if (p->out.count == 0) {
+    shrink_queue(&p->out);
+  }
+
+  memset(&send->msg, 0, sizeof(send->msg));
+  send->msg.msg_iov = send->iov;
+  send->msg.msg_iovlen = n;
+
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = conn->fd;
+  sqe->addr = (unsigned long)&send->msg;
+  sqe->len = 1;
+  // Have the kernel finish short writes itself.
+  sqe->msg_flags = MSG_WAITALL;
+  sqe->user_data = (unsigned long)send | URING_SEND;
+  conn->sending = 1;
+  conn->refs++;
+  uring_pending++;
+}
+
+/*
+ * Queue sends for every client with output waiting. They are all submitted
+ * together by the next uring_submit_and_wait.
+ */
+void uring_flush_clients() {
+  for (int i = 0; i < npending; i++) {
+    struct client *p = pending[i];
+    if (!p->dead && p->io != NULL) {
+      uring_flush_client(p);
+    }
+  }
+  prune_pending();
+}
+
+/*
+ * Handle one io_uring completion.
+ */
+void uring_handle_cqe(struct io_uring_cqe *cqe, int listenfd,
+                      struct client **new_player_list) {
+  unsigned long tag = cqe->user_data & URING_TAG_MASK;
+  void *ptr = (void *)(unsigned long)(cqe->user_data & ~URING_TAG_MASK);
+  int more = cqe->flags & IORING_CQE_F_MORE;
+
+  if (tag == URING_ACCEPT) {
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    memset(&peer, 0, sizeof(peer));
+    if (cqe->res >= 0 &&
+        getpeername(cqe->res, (struct sockaddr *)&peer, &peer_len) < 0) {
+      // Without its address the client cannot be held to the per-address
+      // limits; 0.0.0.0 would share the rate limiter's empty-slot marker.
+      perror("getpeername");
+      close(cqe->res);
+    }
+    else if (cqe->res >= 0) {
+      printf("New connection accepted from %s:%d\n",
+             inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+      tune_client_socket(cqe->res);
+      if (admit_connection(cqe->res, peer.sin_addr)) {
+        struct client *p = new_connection(cqe->res, peer.sin_addr,
+                                          new_player_list);
+        // During an upgrade the client is about to be handed over.
+        if (!uring_quiescing) {
+          uring_attach(p);
+        }
+      }
+    }
+    else if (cqe->res != -ECANCELED) {
+      fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+    }
+    if (!more) {
+      uring_pending--;
+      if (!uring_quiescing) {
+        uring_arm_accept(listenfd);
+      }
+    }
+  }
+  else if (tag == URING_TIMER) {
+    // Whatever was due is handled at the end of this pass.
+    uring_timer = -1;
+  }
+  else if (tag == URING_UPGRADE) {
+    uring_pending--;
+    if (cqe->res > 0) {
+      start_upgrade(listenfd, new_player_list);
+    }
+  }
+  else if (tag == URING_CLUSTER) {
+    uring_pending--;
+    if (cqe->res > 0) {
+      struct client *p = receive_cluster_client(new_player_list);
+      if (p != NULL) {
+        uring_attach(p);
+      }
+      if (cluster_fd != -1) {
+        uring_arm_cluster();
+      }
+    }
+  }
+  else if (tag == URING_RECV) {
+    struct uring_conn *conn = ptr;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (!conn->dead && cqe->res > 0) {
+        handle_input(conn->client, uring_buf(ring, bid), cqe->res,
+                     new_player_list);
+      }
+      uring_recycle_buf(ring, bid);
+    }
+    else if (!conn->dead && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+      // Hang-up (0) or a failed receive.
+      handle_input(conn->client, NULL, cqe->res < 0 ? -1 : 0,
+                   new_player_list);
+    }
+    if (!more) {
+      uring_pending--;
+      if (!conn->dead && !uring_quiescing) {
+        uring_arm_recv(conn);
+      }
+      uring_put_conn(conn);
+    }
+  }
+  else if (tag == URING_SEND) {
+    struct uring_send *send = ptr;
+    struct uring_conn *conn = send->conn;
+    uring_pending--;
+    conn->sending = 0;
+    if (!conn->dead && cqe->res != send->len) {
+      fprintf(stderr, "Write to client failed\n");
+      disconnect_client(conn->client);
+    }
+    for (int i = 0; i < send->count; i++) {
+      release_message(send->msgs[i]);
+    }
+    if (send->trace != NULL && --send->trace->sends == 0) {
+      trace_complete(send->trace);
+    }
+    mem_free(send);
+    uring_put_conn(conn);
+  }
+}
+
+/*
+ * Queue a cancel of the request whose user_data is target.
+ */
+void uring_cancel(unsigned long target) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = target;
+  sqe->user_data = URING_CANCEL;
+}
+
+/*
+ * Stop accepting and receiving, and run the ring until every request in
+ * flight has completed, so that nothing is left for the kernel to deliver
+ * to this process. Sends already queued are allowed to finish.
+ */
+void uring_quiesce(int listenfd, struct client **new_player_list) {
+  struct client *p;
+
+  uring_quiescing = 1;
+  uring_cancel(URING_ACCEPT);
+  for (p = next_client(*new_player_list, NULL); p != NULL;
+       p = next_client(*new_player_list, p)) {
+    if (p->io != NULL) {
+      uring_cancel((unsigned long)p->io | URING_RECV);
+    }
+  }
+
+  while (1) {
+    seat_waiting_players(new_player_list);
+    reap_clients(new_player_list);
+    uring_flush_clients();
+    if (uring_pending == 0) {
+      break;
+    }
+    if (uring_submit_and_wait(ring, 1) == -1) {
+      continue;
+    }
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(ring)) != NULL) {
+      struct io_uring_cqe c = *cqe;
+      uring_cqe_seen(ring);
+      uring_handle_cqe(&c, listenfd, new_player_list);
+    }
+  }
+}
+
+/*
+ * Undo uring_quiesce after an upgrade failed: arm everything again,
+ * attaching any clients that connected in the meantime.
+ */
+void uring_resume(int listenfd, struct client **new_player_list) {
+  struct client *p;
+
+  uring_quiescing = 0;
+  if (listenfd != -1) {
+    uring_arm_accept(listenfd);
+  }
+  uring_arm_upgrade();
+  for (p = next_client(*new_player_list, NULL); p != NULL;
+       p = next_client(*new_player_list, p)) {
+    // Bots have no socket to receive on.
+    if (p->fd < 0) {
+      continue;
+    }
+    if (p->io == NULL) {
+      uring_attach(p);
+    }
+    else {
+      uring_arm_recv(p->io);
+    }
+  }
+}
+
+/*
+ * The io_uring event loop. Accepts and receives stay armed as multishot
+ * requests, so a pass through the loop is one io_uring_enter that submits
+ * every send produced by the last pass and waits for more completions.
+ */
+void run_uring_loop(int listenfd, struct client **new_player_list) {
+  // A cluster backend has no listening socket; its clients come from the
+  // coordinator instead.
+  if (listenfd != -1) {
+    uring_arm_accept(listenfd);
+  }
+  if (upgrade_fd != -1) {
+    uring_arm_upgrade();
+  }
+  if (cluster_fd != -1) {
+    uring_arm_cluster();
+  }
+  // Clients handed over by an older server need receives armed.
+  struct client *p;
+  for (p = next_client(*new_player_list, NULL); p != NULL;
+       p = next_client(*new_player_list, p)) {
+    uring_attach(p);
+  }
+
+  while (1) {
+    check_dump();
+    if (!bots_have_turn()) {
+      uring_arm_timer(next_deadline());
+    }
+    if (uring_submit_and_wait(ring, bots_have_turn() ? 0 : 1) == -1) {
+      continue;
+    }
+    ratelimit_tick();
+    trace_begin_tick();
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(ring)) != NULL) {
+      // Handling a completion can submit new requests, so take a copy and
+      // hand the slot back first.
+      struct io_uring_cqe c = *cqe;
+      uring_cqe_seen(ring);
+      uring_handle_cqe(&c, listenfd, new_player_list);
+    }
+
+    seat_waiting_players(new_player_list);
+    expire_turns();
+    tend_bots(new_player_list);
+    reap_clients(new_player_list);
+    cluster_report();
+    tend_checkpoint();
+    // The pass's trace is complete once the kernel has sent everything.
+    trace_sending = end_traced_tick();
+    uring_flush_clients();
+    if (trace_sending != NULL && trace_sending->sends == 0) {
+      trace_complete(trace_sending);
+    }
+    trace_sending = NULL;
+    if (recording != NULL) {
+      record_flush();
+    }
+  }
+}
+
+/*
+ * Accept a new server binary on upgrade_fd and hand everything over to it.
+ * This process exits once the new one has confirmed the handoff; if the
+ * handoff fails, it carries on serving as if nothing happened.
+ */
+void start_upgrade(int listenfd, struct client **new_player_list) {
+  int sock = accept(upgrade_fd, NULL, NULL);
+  if (sock < 0) {
+    perror("accept");
+    if (ring != NULL) {
+      uring_arm_upgrade();
+    }
+    return;
+  }
+  printf("Handing over to a new server\n");
+
+  // Nothing may still be in flight or queued when the sockets change hands.
+  if (ring != NULL) {
+    uring_quiesce(listenfd, new_player_list);
+  }
+  else {
+    drain_output(new_player_list);
+  }
+  if (recording != NULL) {
+    record_flush();
+  }
+
+  if (hand_off(sock, listenfd, *new_player_list) == 0) {
+    printf("Handoff complete\n");
+    exit(0);
+  }
+  fprintf(stderr, "Upgrade failed; carrying on\n");
+  close(sock);
+  if (ring != NULL) {
+    uring_resume(listenfd, new_player_list);
+  }
+}
+
+/*
+ * Finish the pass, then give the clients whose output is still waiting up
+ * to UPGRADE_DRAIN to take it, and drop those that have not by then rather
+ * than hand them over with a gap in what they were sent.
+ */
+void drain_output(struct client **new_player_list) {
+  ratelimit_tick();
+  long give_up = ratelimit_clock + UPGRADE_DRAIN;
+  finish_tick(new_player_list);
+  while (npending > 0 && ratelimit_clock < give_up) {
+    // Only room in the socket buffers of clients still behind matters now.
+    int nfds = build_pollset(-1, *new_player_list);
+    poll(pollset + pollset_clients, nfds - pollset_clients,
+         (give_up - ratelimit_clock) / 1000 + 1);
+    ratelimit_tick();
+    finish_tick(new_player_list);
+  }
+  for (int i = 0; i < npending; i++) {
+    printf("[%d] Still behind on its output; dropping it\n", pending[i]->fd);
+    disconnect_client(pending[i]);
+  }
+  finish_tick(new_player_list);
+}
+
+/*
+ * Send every room over sock, UPGRADE_BATCH at a time, noting which client
+ * has the turn in each. Return 0 on success and -1 on failure.
+ */
+int send_rooms(int sock, struct client *new_players) {
+  struct upgrade_room *rooms =
+    mem_calloc(MEM_BUFFERS, lobby.nrooms + 1, sizeof(struct upgrade_room));
+  int nclients = 0;
+  struct client *p;
+
+  if (rooms == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  for (int r = 0; r < lobby.nrooms; r++) {
+    struct game_state *game = lobby.rooms[r];
+    strcpy(rooms[r].word, game->word);
+    strcpy(rooms[r].guess, game->guess);
+    memcpy(rooms[r].letters_guessed, game->letters_guessed,
+           sizeof(rooms[r].letters_guessed));
+    rooms[r].guesses_left = game->guesses_left;
+    rooms[r].turn = -1;
+  }
+  // Clients are numbered in the order send_clients will send them.
+  for (p = next_client(new_players, NULL); p != NULL;
+       p = next_client(new_players, p)) {
+    if (p->fd < 0) {
+      continue;
+    }
+    if (p->room != NULL && p == p->room->has_next_turn) {
+      rooms[p->room->slot].turn = nclients;
+    }
+    nclients++;
+  }
+
+  for (int r = 0; r < lobby.nrooms; r += UPGRADE_BATCH) {
+    int n = lobby.nrooms - r < UPGRADE_BATCH ? lobby.nrooms - r
+                                             : UPGRADE_BATCH;
+    if (send_with_fds(sock, rooms + r, n * sizeof(struct upgrade_room),
+                      NULL, 0) == -1) {
+      mem_free(rooms);
+      return -1;
+    }
+  }
+  mem_free(rooms);
+  return 0;
+}
+
+/*
+ * Send every client over sock, UPGRADE_BATCH at a time with their socket
+ * descriptors attached. Return 0 on success and -1 on failure.
+ */
+int send_clients(int sock, struct client *new_players) {
+  struct upgrade_client *batch =
+    mem_malloc(MEM_BUFFERS, UPGRADE_BATCH * sizeof(struct upgrade_client));
+  int fds[UPGRADE_BATCH];
+  int n = 0;
+  struct client *p;
+
+  if (batch == NULL) {
+    perror("malloc");
+    return -1;
+  }
+  for (p = next_client(new_players, NULL); p != NULL;
+       p = next_client(new_players, p)) {
+    // Bots have no socket to pass on; the new binary makes its own.
+    if (p->fd < 0) {
+      continue;
+    }
+    struct upgrade_client *rec = &batch[n];
+    memset(rec, 0, sizeof(*rec));
+    if (p->room == NULL) {
+      rec->role = ROLE_NEW_PLAYER;
+      rec->room = -1;
+    }
+    else {
+      rec->role = p->watching ? ROLE_SPECTATOR : ROLE_PLAYER;
+      rec->room = p->room->slot;
+    }
+    rec->ipaddr = p->ipaddr;
+    strcpy(rec->name, p->name);
+    rec->inlen = p->inlen;
+    if (p->inbuf != NULL) {
+      memcpy(rec->inbuf, p->inbuf, rec->inlen);
+    }
+    fds[n++] = p->fd;
+
+    if (n == UPGRADE_BATCH) {
+      if (send_with_fds(sock, batch, n * sizeof(*rec), fds, n) == -1) {
+        mem_free(batch);
+        return -1;
+      }
+      n = 0;
+    }
+  }
+  if (n > 0 && send_with_fds(sock, batch, n * sizeof(struct upgrade_client),
+                             fds, n) == -1) {
+    mem_free(batch);
+    return -1;
+  }
+  mem_free(batch);
+  return 0;
+}
+
+/*
+ * Send the size of the handoff and listenfd over sock, then every room,
+ * then every client with its socket descriptor, and wait for the other end
+ * to confirm it has them. Return 0 on success and -1 if the handoff failed.
+ */
+int hand_off(int sock, int listenfd, struct client *new_players) {
+  struct upgrade_header header;
+  struct client *p;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = UPGRADE_MAGIC;
+  header.nrooms = lobby.nrooms;
+  header.dict_size = lobby.dict.size;
+  for (p = next_client(new_players, NULL); p != NULL;
+       p = next_client(new_players, p)) {
+    if (p->fd >= 0) {
+      header.nclients++;
+    }
+  }
+  if (send_with_fds(sock, &header, sizeof(header), &listenfd, 1) == -1 ||
+      send_rooms(sock, new_players) == -1 ||
+      send_clients(sock, new_players) == -1) {
+    return -1;
+  }
+
+  char ack;
+  if (read(sock, &ack, 1) != 1) {
+    fprintf(stderr, "New server did not confirm the handoff\n");
+    return -1;
   }
+  return 0;
 }
 
-/* Disconnect an active player from the game. */
-void disconnect_activeplayer(struct game_state *game, struct client *p) {
-  char goodbye_msg[MAX_MSG];
-  sprintf(goodbye_msg, "%s left the game.\r\n", p->name);
+/*
+ * Receive the rooms, the listening socket and every client from the server
+ * on the other end of sock, rebuilding the rooms and the client lists in
+ * the order they were sent. Return the listening socket.
+ */
+int take_over(int sock, struct client **new_player_list) {
+  struct upgrade_header header;
+  int listenfd;
 
-  int dp_fd = p->fd;
+  if (recv_with_fds(sock, &header, sizeof(header), &listenfd, 1) != 1 ||
+      header.magic != UPGRADE_MAGIC) {
+    fprintf(stderr, "Bad upgrade header\n");
+    exit(1);
+  }
+  if (header.dict_size != lobby.dict.size) {
+    fprintf(stderr, "Running server has a %d word dictionary, not %d\n",
+            header.dict_size, lobby.dict.size);
+    exit(1);
+  }
 
-  // If the next turn is the player who disconnected, advance the turn.
-  if (game->has_next_turn != NULL && game->has_next_turn->fd == dp_fd) {
-      advance_turn(game);
+  struct upgrade_room *rooms =
+    mem_calloc(MEM_BUFFERS, header.nrooms + 1, sizeof(struct upgrade_room));
+  struct upgrade_client *batch =
+    mem_malloc(MEM_BUFFERS, UPGRADE_BATCH * sizeof(struct upgrade_client));
+  int fds[UPGRADE_BATCH];
+  if (rooms == NULL || batch == NULL) {
+    perror("malloc");
+    exit(1);
   }
-  // If the game has only one player, reset the game head and the next turn.
-  if (count_players(game) == 1) {
-    game->head = NULL;
-    game->has_next_turn = NULL;
-    printf("Removing client %d %s\n", dp_fd, inet_ntoa(p->ipaddr));
-    FD_CLR(p->fd, &allset);
-    close(p->fd);
-    free(p);
-  }
-  // If the player is in the front of the linked list, replace the front.
-  else if (game->head != NULL && game->head->fd == dp_fd) {
-    struct client *front = p->next;
-    game->head = front;
-    printf("Removing client %d %s\n", dp_fd, inet_ntoa(p->ipaddr));
-    FD_CLR(p->fd, &allset);
-    close(p->fd);
-    free(p);
-  }
-  // If the player is the in the tail of the linked list, replace the tail.
-  else if (p->next == NULL) {
-    struct client *back;
-    for (back = game->head; back->next->fd!= dp_fd; back = back->next);
-    back->next = NULL;
-    printf("Removing client %d %s\n", dp_fd, inet_ntoa(p->ipaddr));
-    FD_CLR(p->fd, &allset);
-    close(p->fd);
-    free(p);
+  for (int r = 0; r < header.nrooms; r += UPGRADE_BATCH) {
+    int count = header.nrooms - r < UPGRADE_BATCH ? header.nrooms - r
+                                                  : UPGRADE_BATCH;
+    if (recv_with_fds(sock, rooms + r, count * sizeof(struct upgrade_room),
+                      NULL, 0) != 0) {
+      fprintf(stderr, "Bad upgrade room\n");
+      exit(1);
+    }
   }
-  // If the player is in the middle, replace the players before and after.
-  else {
-    struct client *next = p->next;
-    struct client *back;
-    for (back = game->head; back->next->fd != dp_fd; back = back->next);
-    back->next = next;
-    printf("Removing client %d %s\n", dp_fd, inet_ntoa(p->ipaddr));
-    FD_CLR(p->fd, &allset);
-    close(p->fd);
-    free(p);
+  for (int r = 0; r < header.nrooms; r++) {
+    struct game_state *game = open_room();
+    strcpy(game->word, rooms[r].word);
+    strcpy(game->guess, rooms[r].guess);
+    memcpy(game->letters_guessed, rooms[r].letters_guessed,
+           sizeof(game->letters_guessed));
+    game->guesses_left = rooms[r].guesses_left;
+  }
+
+  // Each list arrives in one piece, so appending to the list the last
+  // client went to preserves the turn order.
+  struct client **tail = NULL;
+  struct client **list = NULL;
+  int received = 0;
+  while (received < header.nclients) {
+    int n = header.nclients - received;
+    if (n > UPGRADE_BATCH) {
+      n = UPGRADE_BATCH;
     }
-    // Announce that the player has left if there are still players in the game.
-    if (count_players(game) > 0) {
-      broadcast(game, goodbye_msg);
-      announce_turn(game);
+    if (recv_with_fds(sock, batch, n * sizeof(struct upgrade_client),
+                      fds, n) != n) {
+      fprintf(stderr, "Bad upgrade batch\n");
+      exit(1);
     }
+    for (int i = 0; i < n; i++) {
+      struct upgrade_client *rec = &batch[i];
+      if (rec->role < ROLE_PLAYER || rec->role > ROLE_SPECTATOR ||
+          rec->room < -1 || rec->room >= header.nrooms ||
+          (rec->room == -1) != (rec->role == ROLE_NEW_PLAYER)) {
+        fprintf(stderr, "Bad upgrade record\n");
+        exit(1);
+      }
+      struct game_state *game = rec->room == -1 ? NULL
+                                : lobby.rooms[rec->room];
+      struct client **target = game == NULL ? new_player_list
+                               : rec->role == ROLE_SPECTATOR
+                               ? &(game->spectators) : &(game->head);
+      if (target != list) {
+        list = target;
+        tail = target;
+      }
+      // An older binary may have left the socket blocking.
+      tune_client_socket(fds[i]);
+      add_player(tail, fds[i], rec->ipaddr);
+      ratelimit_track(rec->ipaddr);
+      struct client *p = *tail;
+      tail = &p->next;
+      p->room = game;
+      p->watching = rec->role == ROLE_SPECTATOR;
+
+      strncpy(p->name, rec->name, MAX_NAME - 1);
+      p->name[MAX_NAME - 1] = '\0';
+      if (p->name[0] != '\0') {
+        names_claim(p->name, p);
+        // Named but not yet seated when the old server stopped.
+        if (game == NULL) {
+          lobby_wait(&lobby, p);
+        }
+      }
+      if (rec->inlen > 0 && rec->inlen < MAX_BUF) {
+        p->inbuf = pool_get(&inbuf_pool);
+        memcpy(p->inbuf, rec->inbuf, rec->inlen);
+        p->inlen = rec->inlen;
+      }
+      if (game != NULL && rec->role == ROLE_PLAYER) {
+        game->seated++;
+        lobby.players++;
+        if (received + i == rooms[rec->room].turn) {
+          game->has_next_turn = p;
+        }
+      }
+    }
+    received += n;
+  }
+  mem_free(batch);
+  mem_free(rooms);
+  for (int r = 0; r < lobby.nrooms; r++) {
+    struct game_state *game = lobby.rooms[r];
+    // If a bot had the turn, it goes to whoever is first in line.
+    if (game->has_next_turn == NULL) {
+      game->has_next_turn = game->head;
+    }
+    // Whoever has the turn starts with the whole of it again.
+    start_turn_clock(game);
+    lobby_update(&lobby, game);
+  }
+
+  char ack = 1;
+  if (write(sock, &ack, 1) != 1) {
+    perror("write");
+    exit(1);
+  }
+  close(sock);
+  printf("Took over %d clients in %d rooms\n", header.nclients,
+         header.nrooms);
+  return listenfd;
 }
 
 /*
- * Create a new game after the previous game finished.
+ * Receive a client that the cluster coordinator has placed on this backend
+ * and add it to the new player list. If the coordinator has gone, stop
+ * listening to it; the clients already here play on.
+ * Return the new client, or NULL if there was none.
  */
-void new_game(struct game_state *game) {
-  char buf[MAX_WORD];
-  rewind(game->dict.fp);
+struct client *receive_cluster_client(struct client **new_player_list) {
+  struct cluster_client rec;
+  int clientfd;
 
-  // Choose a random word.
-  int index = random() % game->dict.size;
-  printf("Looking for word at index %d\n", index);
-  for(int i = 0; i <= index; i++) {
-      if(!fgets(buf, MAX_WORD, game->dict.fp)){
-          fprintf(stderr,"File ended before we found the entry index %d",index);
-          exit(1);
-      }
+  if (recv_with_fds(cluster_fd, &rec, sizeof(rec), &clientfd, 1) != 1) {
+    fprintf(stderr, "Lost the cluster coordinator\n");
+    close(cluster_fd);
+    cluster_fd = -1;
+    return NULL;
   }
+  cluster_received++;
+  tune_client_socket(clientfd);
+  // The coordinator has already applied the connection limits, and counts
+  // the client until it is told the client has closed.
+  ratelimit_track(rec.ipaddr);
+  return new_connection(clientfd, rec.ipaddr, new_player_list);
+}
 
-  if(buf[strlen(buf) - 1] == '\n') {
-      buf[strlen(buf) - 1] = '\0';
-  } else {
-      fprintf(stderr,
-        "The dictionary file does not appear to have Unix line endings\n");
-  }
-  strncpy(game->word, buf, MAX_WORD);
-  game->word[MAX_WORD-1] = '\0';
-  for(int j = 0; j < strlen(game->word); j++) {
-      game->guess[j] = '-';
+/*
+ * Remember to tell the coordinator that a client from addr has closed.
+ */
+void cluster_closed_add(struct in_addr addr) {
+  if (ncluster_closed == cluster_closed_cap) {
+    cluster_closed_cap = cluster_closed_cap < 64 ? 64 : cluster_closed_cap * 2;
+    cluster_closed = mem_realloc(MEM_CLIENTS, cluster_closed,
+                                 cluster_closed_cap * sizeof(struct in_addr));
+    if (cluster_closed == NULL) {
+      perror("realloc");
+      exit(1);
+    }
   }
-  game->guess[strlen(game->word)] = '\0';
+  cluster_closed[ncluster_closed++] = addr;
+}
 
-  for(int i = 0; i < NUM_LETTERS; i++) {
-      game->letters_guessed[i] = 0;
-  }
-  game->guesses_left = MAX_GUESSES;
+/*
+ * Return 1 if a and b hold the same counts. The fields are compared one by
+ * one, as the padding after rooms need not match.
+ */
+int same_load(struct cluster_load *a, struct cluster_load *b) {
+  return a->clients == b->clients && a->players == b->players &&
+         a->rooms == b->rooms && a->received == b->received;
 }
 
 /*
- * Advance the turn and adjust the one who has the next turn.
+ * Send the coordinator this backend's load if it differs from the last
+ * report, together with the clients that have closed since, in as many
+ * reports as that takes. A report that cannot be sent right away is
+ * retried next pass.
  */
-void advance_turn(struct game_state *game) {
-  if (count_players(game) > 1) {
-    // If the player is the head of the list, then advance the turn to the
-    // player in the tail of the list.
-    if ((game->has_next_turn->fd) == (game->head->fd)) {
-      struct client *c;
-      for (c = game->head; c->next != NULL; c = c->next);
-      game->has_next_turn = c;
-    }
-    // If the player is in the middle of the list, then advance the turn to
-    // the player before them.
-    else {
-      struct client *p;
-      for (p = game->head; ((p != NULL)
-                            && (p->next->fd != game->has_next_turn->fd));
-                            p = p->next);
-      game->has_next_turn = p;
-    }
+void cluster_report() {
+  struct cluster_report report;
+  struct cluster_load load = {connected_clients, lobby.players, lobby.nrooms,
+                              cluster_received};
+
+  if (cluster_fd == -1) {
+    return;
   }
-  if (count_players(game) >= 1) {
-    announce_turn(game);
+  memset(&report, 0, sizeof(report));
+  report.load = load;
+  while (ncluster_closed > 0 || !same_load(&load, &cluster_load)) {
+    int n = ncluster_closed < CLUSTER_CLOSED_BATCH ? ncluster_closed
+                                                   : CLUSTER_CLOSED_BATCH;
+    report.nclosed = n;
+    memcpy(report.closed, cluster_closed + ncluster_closed - n,
+           n * sizeof(struct in_addr));
+    if (send(cluster_fd, &report, sizeof(report), MSG_DONTWAIT) !=
+        sizeof(report)) {
+      return;
+    }
+    cluster_load = load;
+    ncluster_closed -= n;
   }
 }
 
 /*
- * Announce whose turn it is, based on who has the next turn.
+ * Tell p how many dictionary words still fit the gameboard and which
+ * HINT_LETTERS letters the most of them contain.
  */
-void announce_turn(struct game_state *game) {
-  // String to declare whose turn it is.
-  char turn[MAX_MSG];
-  sprintf(turn, "It's %s's turn.\r\n", (game->has_next_turn)->name);
-  char *guess_msg = "Your guess?\r\n";
-  // Strings to declare the outcome of the game.
-  char win[MAX_MSG];
-  sprintf(win, "Game over. %s won!\r\n", (game->has_next_turn)->name);
-  char *game_over = "Game over. You've exhausted all the guesses.\r\n";
-  // String to reveal the word once the game is over.
-  char word[MAX_MSG];
-  sprintf(word, "The word was %s.\r\n", game->word);
-  // String to announce a new game.
-  char *new_game_msg = "Let's start a new game.\r\n";
-  // String to display the current gameboard.
-  char game_display[MAX_MSG];
+void send_hint(struct client *p, struct game_state *game) {
+  int counts[NUM_LETTERS];
+  char hint[MAX_MSG];
 
-  // Announce turn iff there are still guesses left and the word has not
-  // been guessed yet.
-  if ((game->guesses_left > 0) && (strcmp(game->word, game->guess) != 0)) {
-    struct client *p;
-    for (p = game->head; p != NULL; p = p->next) {
-      // If the player does not have the next turn, announce whose turn it is.
-      if (p->fd != (game->has_next_turn)->fd) {
-        if (write(p->fd, turn, strlen(turn)) == -1) {
-          fprintf(stderr, "Write to client failed\n");
-          disconnect_activeplayer(game, p);
-        };
-      }
-      // If the player does have the next turn, prompt guess.
-      else {
-        if(write(p->fd, guess_msg, strlen(guess_msg)) == -1) {
-          fprintf(stderr, "Write to client failed\n");
-          disconnect_activeplayer(game, p);
-        };
-      }
-    }
+  int total = solver_rank(&engine, game->guess, game->letters_guessed,
+                          counts);
+  if (total == 0) {
+    send_message(p, "No word in the dictionary fits.\r\n");
+    return;
   }
-  // Game over
-  else {
-    if (strcmp(game->word, game->guess) == 0) {
-      broadcast(game, word);
-      broadcast(game, win);
+  int len = sprintf(hint, "%d word%s fit%s. Try", total,
+                    total == 1 ? "" : "s", total == 1 ? "s" : "");
+  for (int k = 0; k < HINT_LETTERS; k++) {
+    int best = -1;
+    for (int c = 0; c < NUM_LETTERS; c++) {
+      if (counts[c] > 0 && (best == -1 || counts[c] > counts[best])) {
+        best = c;
+      }
     }
-    else {
-      broadcast(game, word);
-      broadcast(game, game_over);
+    if (best == -1) {
+      break;
     }
-    // Create a new game.
-    broadcast(game, new_game_msg);
-    new_game(game);
-    char *game_display_message = status_message(game_display, game);
-    broadcast(game, game_display_message);
-    announce_turn(game);
+    len += sprintf(hint + len, "%s %c (%d%%)", k > 0 ? "," : "", 'a' + best,
+                   counts[best] * 100 / total);
+    counts[best] = 0;
   }
+  strcpy(hint + len, ".\r\n");
+  send_message(p, hint);
 }
 
 /*
- * Move a player from the new_player_list to the active game list.
+ * Keep the room at bot_target players: remove bots while there are more
+ * players than that, and add bots while there are fewer. A room with
+ * nobody seated gets no bots, so that it can be retired.
  */
-void move_player(struct client **new_player_list, struct client *player,
-                 struct game_state *game, int fd) {
-  // Add the player to the game head.
-  struct in_addr addr;
-  addr.s_addr = player->ipaddr.s_addr;
-  add_player(&(game->head), fd, addr);
-  struct client *game_player = search(fd, game);
-  strcpy(game_player->name, player->name);
+void balance_bots(struct game_state *game) {
+  int players = count_players(game);
+  int target = game->seated > 0 ? bot_target : 0;
+  struct client *p;
 
-  // Remove the player from the new player list.
-  struct client **curr_p;
-  for (curr_p = new_player_list; *curr_p && (*curr_p)->fd != fd;
-       curr_p = &(*curr_p)->next)
-      ;
-  if (*curr_p) {
-    struct client *t = (*curr_p)->next;
-    printf("Removing client %d %s\n", fd, inet_ntoa((*curr_p)->ipaddr));
-    *curr_p = t;
+  for (p = game->head; p != NULL && players > target; p = p->next) {
+    if (!p->dead && p->fd < 0) {
+      disconnect_client(p);
+      players--;
+    }
   }
-  else {
-    fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
-             fd);
+  for (; players < target; players++) {
+    add_bot(game);
   }
 }
 
 /*
- * Move a player from the new_player_list to the active game list.
+ * Add a bot to the room under the first free name of the form "botN".
  */
-struct client *search(int fd, struct game_state *game) {
-  struct client *p;
+void add_bot(struct game_state *game) {
+  char name[MAX_NAME];
+  struct game_events ev;
+  struct client *p = NULL;
+  struct in_addr addr;
+  addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int id;
+  do {
+    id = next_bot_id++;
+    sprintf(name, "bot%d", id);
+  } while (check_name(name));
+  add_player(&p, -id, addr);
+  strcpy(p->name, name);
+  names_claim(p->name, p);
+
+  ev.n = 0;
+  game_join(game, p, &ev);
+  play_events(game, &ev);
+}
+
+/*
+ * Return 1 if a bot has the turn and there is at least one person in the
+ * game to play against, and 0 otherwise. Bots never play on their own, so
+ * an empty game costs nothing.
+ */
+int bot_has_turn(struct game_state *game) {
+  struct client *p = game->has_next_turn;
+  if (p == NULL || p->dead || p->fd >= 0) {
+    return 0;
+  }
   for (p = game->head; p != NULL; p = p->next) {
-    if (p->fd == fd) {
-      return p;
+    if (!p->dead && p->fd >= 0) {
+      return 1;
     }
   }
-  return p;
+  return 0;
 }
 
 /*
- * Count the number of active players in the current game.
+ * Return 1 if a bot has the turn in any room, so the event loop should
+ * not block.
  */
-int count_players(struct game_state *game) {
-  struct client *p;
-  int num_players = 0;
-  for (p = game->head; p != NULL; p = p->next) {
-      num_players += 1;
+int bots_have_turn() {
+  for (int r = 0; r < lobby.nrooms; r++) {
+    if (bot_has_turn(lobby.rooms[r])) {
+      return 1;
+    }
   }
-  return num_players;
+  return 0;
 }
 
 /*
- * Broadcast outbuf to everyone in the game.
+ * Make the guesses of bots holding the turn, up to MAX_BOT_MOVES of them,
+ * so that a lucky bot cannot hold up the event loop.
  */
-void broadcast(struct game_state *game, char *outbuf) {
-    struct client *p;
-    for (p = game->head; p != NULL; p = p->next) {
-        if (write(p->fd, outbuf, strlen(outbuf)) == -1) {
-          fprintf(stderr, "Write to client failed\n");
-          disconnect_activeplayer(game, p);
-        };
-    }
+void run_bots(struct game_state *game) {
+  char line[2] = {'\0', '\0'};
+  for (int moves = 0; moves < MAX_BOT_MOVES && bot_has_turn(game); moves++) {
+    line[0] = solver_best_letter(&engine, game->guess,
+                                 game->letters_guessed);
+    handle_client_guess(game->has_next_turn, game, line);
+  }
 }
 
 /*
- * Check if there is a player with the same name in the game.
+ * Bring every room back to bot_target players, removing the bots that make
+ * way for people before anyone guesses, and then let bots take their turns.
  */
-int check_name(char *name, struct game_state *game) {
-  struct client *p;
-  for (p = game->head; p != NULL; p = p->next) {
-    if (strcmp(p->name, name) == 0) {
-      return 1;
+void tend_bots(struct client **new_player_list) {
+  if (bot_target > 0) {
+    for (int r = 0; r < lobby.nrooms; r++) {
+      balance_bots(lobby.rooms[r]);
+    }
+    reap_clients(new_player_list);
+    for (int r = 0; r < lobby.nrooms; r++) {
+      run_bots(lobby.rooms[r]);
     }
   }
-  return 0;
+}
+
+/*
+ * Check if any player on the server has already claimed name.
+ */
+int check_name(char *name) {
+  return names_lookup(name) != NULL;
 }
 
 /*
@@ -375,322 +2618,243 @@ int find_network_newline(const char *buf, int n) {
 }
 
 /*
- * Handle the client's guess.
+ * Copy as much of the len bytes in buf as fits onto the end of p's pending
+ * input, taking an input buffer from the pool if p has none. A line that
+ * does not fit in inbuf can never be valid, so it is thrown away to make
+ * room. Return the number of bytes consumed.
  */
-void handle_client_guess(struct client *p, struct game_state *game) {
-  // Strings to inform the player about their guesses.
-  char *empty_guess_msg = "Please, enter a non-empty guess.\r\n";
-  char *single_guess_msg = "Please, enter a single guess.\r\n";
-  char *already_in_word = "The letter has already been guessed. Try again.\r\n";
-  char *lower_case_msg = "The letter should be in lower-case.\r\n";
-  char *incorrect_guess = "That was an incorrect guess.\r\n";
-  char *not_turn = "It's not your turn to guess.\r\n";
-
-  // A string to hold the whole guess.
-  char *whole_line = malloc(sizeof(char) * (MAX_BUF + 1));
-  if (whole_line == NULL) {
-      perror("malloc");
-      exit(1);
+int append_input(struct client *p, const char *buf, int len) {
+  if (p->inbuf == NULL) {
+    p->inbuf = pool_get(&inbuf_pool);
+    p->inlen = 0;
+  }
+  int room = MAX_BUF - 1 - p->inlen;
+  if (room == 0) {
+    fprintf(stderr, "[%d] Line too long, discarding it\n", p->fd);
+    p->inlen = 0;
+    room = MAX_BUF - 1;
   }
-  whole_line[0] = '\0';
-  int len_guess, len, where, inbuf, room;
-  int newline_flag = 1;
-  int disconnect_flag = 1;
-  int red_flag = 1;
-  // Call select and read until a newline character is found.
-  while (newline_flag == 1) {
-    inbuf = 0;
-    room = sizeof(p->inbuf);
+  int n = len < room ? len : room;
+  memcpy(p->inbuf + p->inlen, buf, n);
+  p->inlen += n;
+  return n;
+}
 
-    len = read(p->fd, p->in_ptr, room);
+/*
+ * If p's pending input holds a complete line, move it (without the network
+ * newline, and cut short at the first character that is not a letter) into
+ * line, which must have room for MAX_BUF bytes, and return 1.
+ * Otherwise return 0.
+ */
+int next_line(struct client *p, char *line) {
+  if (p->inbuf == NULL) {
+    return 0;
+  }
+  int where = find_network_newline(p->inbuf, p->inlen);
+  if (where < 0) {
+    return 0;
+  }
+  printf("[%d] Found newline\n", p->fd);
 
-    if (len == 0) {
-        disconnect_flag = 0;
-        disconnect_activeplayer(game, p);
-        break;
-    }
-    else if (len < 0) {
-      fprintf(stderr, "Read from client failed\n");
-      remove_player(&(game->head), p->fd);
+  memcpy(line, p->inbuf, where - 2);
+  line[where - 2] = '\0';
+  for (int i = 0; line[i] != '\0'; i++) {
+    if (!((line[i] >= 'a' && line[i] <= 'z')
+        || (line[i] >= 'A' && line[i] <= 'Z'))) {
+      line[i] = '\0';
+      break;
     }
+  }
+
+  // Keep anything after the newline for the next call. A client with no
+  // partial line left gives its buffer back.
+  p->inlen -= where;
+  if (p->inlen == 0) {
+    pool_put(&inbuf_pool, p->inbuf);
+    p->inbuf = NULL;
+  }
+  else {
+    memmove(p->inbuf, p->inbuf + where, p->inlen);
+  }
+  return 1;
+}
 
-    inbuf += len;
-    if ((where = find_network_newline(p->inbuf, inbuf)) < 0) {
-        newline_flag = 1;
-        room -= len;
+/*
+ * Handle len bytes read from p's socket descriptor. A len of 0 means the
+ * client hung up and a negative len means the read failed.
+ * Whichever backend is driving the server reads the socket and knows which
+ * client it belongs to; this decides what the bytes mean based on which
+ * list the client is in.
+ */
+void handle_input(struct client *p, const char *buf, int len,
+                  struct client **new_player_list) {
+  char line[MAX_BUF];
+
+  if (recording != NULL) {
+    if (len > 0) {
+      record_input(p->fd, buf, len);
     }
     else {
-      newline_flag = 0;
+      record_close(p->fd);
     }
-    strncat(whole_line, p->inbuf, room);
-    room -= len;
   }
-  // Add null terminator to the whole_line inputted by user.
-  if (newline_flag == 0) {
-    for (int i = 0; i < MAX_BUF; i++) {
-      if (!((whole_line[i] >= 'a' && whole_line[i] <= 'z')
-          || (whole_line[i] >= 'A' && whole_line[i] <= 'Z'))) {
-            whole_line[i] = '\0';
-            break;
-          }
-    }
-    len_guess = strlen(whole_line);
+  if (len < 0) {
+    fprintf(stderr, "Read from client failed\n");
   }
-  else {
-    whole_line[0] = '\0';
-    len_guess = strlen(whole_line);
-  }
-
-  // If the player has not disconnected and it's not their turn, inform.
-  if (disconnect_flag == 1 && (game->has_next_turn->fd != p->fd)) {
-      if(write(p->fd, not_turn, strlen(not_turn)) == -1) {
-        fprintf(stderr, "Write to client failed\n");
-        disconnect_activeplayer(game, p);
-      };
-  }
-  // If the player has not disconnected and it's their turn, process the guess.
-  else if (disconnect_flag == 1 && (game->has_next_turn->fd == p->fd)) {
-    // Empty guess.
-    if (len_guess == 0) {
-      p->inbuf[0] = '\0';
-      whole_line[0] = '\0';
-      if(write(p->fd, empty_guess_msg, strlen(empty_guess_msg)) == -1) {
-          fprintf(stderr, "Write to client failed\n");
-          disconnect_activeplayer(game, p);
-      };
-    }
-    // Guess with more than one character.
-    else if ((len_guess) > 1) {
-      p->inbuf[0] = '\0';
-      whole_line[0] = '\0';
-      if(write(p->fd, single_guess_msg, strlen(single_guess_msg)) == -1) {
-          fprintf(stderr, "Write to client failed\n");
-          disconnect_activeplayer(game, p);
-      };
-    }
-    // A single guess.
-    else if ((len_guess) == 1) {
-      int letter;
-      letter = *(whole_line);
-      // Check if the letter is lower-case.
-      if (islower(letter) == 0) {
-        p->inbuf[0] = '\0';
-        whole_line[0] = '\0';
-        inbuf -= where;
-        if(write(p->fd, lower_case_msg, strlen(lower_case_msg)) == -1) {
-            fprintf(stderr, "Write to client failed\n");
-            disconnect_activeplayer(game, p);
-        };
-      }
-      else {
-        char guess = *whole_line;
-        int position = guess - 'a';
-        // Check if the letter has already been guessed.
-        if (game->letters_guessed[position] == 1) {
-          inbuf -= where;
-          p->inbuf[0] = '\0';
-          whole_line[0] = '\0';
-          if(write(p->fd, already_in_word, strlen(already_in_word)) == -1) {
-              fprintf(stderr, "Write to client failed\n");
-              disconnect_activeplayer(game, p);
-          };
-        }
-        // A valid guess. Proper format and has not already been guessed.
-        else {
-          red_flag = 0;
-          printf("[%d] Read %d bytes\n", p->fd, inbuf);
-          inbuf -= where;
-          printf("[%d] Found newline %s\n", p->fd, p->inbuf);
+  if (len <= 0) {
+    disconnect_client(p);
+    return;
+  }
+  if (p->dead) {
+    return;
+  }
+
+  // An active player
+  if (p->room != NULL && !p->watching) {
+    struct game_state *game = p->room;
+    if (tracing) {
+      trace_room(count_room(game));
+    }
+    TRACE_STAGE(STAGE_READ);
+    while (len > 0) {
+      int n = append_input(p, buf, len);
+      buf += n;
+      len -= n;
+      while (next_line(p, line)) {
+        if (line_allowed(p)) {
+          TRACE_STAGE(STAGE_LINE);
+          handle_client_guess(p, game, line);
+          TRACE_STAGE(STAGE_QUEUED);
         }
       }
     }
+    return;
   }
-  // String to hold the current guess.
-  char announce_guess[MAX_BUF];
-
-  if (red_flag == 0 && (game->has_next_turn->fd == p->fd)) {
-    char guess = *(whole_line);
-    int position = guess - 'a';
-    int in_word = 0;
 
-    for (int j = 0; j < MAX_WORD; j++) {
-      if (game->word[j] == guess) {
-        in_word = 1;
-        game->guess[j] = guess;
+  // Spectators only ever send noise or hang up.
+  if (p->room != NULL) {
+    while (len > 0) {
+      int n = append_input(p, buf, len);
+      buf += n;
+      len -= n;
+      while (next_line(p, line)) {
+        if (line_allowed(p)) {
+          handle_spectator_line(p);
+        }
       }
     }
-    // Correct guess.
-    if (in_word) {
-      game->guesses_left -= 1;
-      game->letters_guessed[position] = 1;
-      printf("That was a correct guess by %s.\n", p->name);
-      sprintf(announce_guess, "%s guesses: %c\r\n", p->name, guess);
-      broadcast(game, announce_guess);
-      display_game(game, p->fd);
-      announce_turn(game);
-    }
-    // Incorrect guess.
-    else {
-      game->guesses_left -= 1;
-      game->letters_guessed[position] = 1;
-      if(write(p->fd, incorrect_guess, strlen(incorrect_guess)) == -1) {
-         fprintf(stderr, "Write to client failed\n");
-         disconnect_activeplayer(game, p);
-       };
-       printf("That was an incorrect guess by %s.\n", p->name);
-       sprintf(announce_guess, "%s guesses: %c\r\n", p->name, guess);
-       broadcast(game, announce_guess);
-       display_game(game, p->fd);
-       if (game->guesses_left == 0 || strcmp(game->word, game->guess) == 0) {
-         announce_turn(game);
-       }
-       else {
-         advance_turn(game);
-       }
-    }
-  }
-  free(whole_line);
-}
-
-/*
- * Handle the client's name.
- */
-void handle_client_name(struct client *p, struct client **new_player_list,
-                        struct game_state *game) {
-  // String to hold the whole name.
-  char *whole_name = malloc(sizeof(char) * MAX_BUF + 1);
-  if (whole_name == NULL) {
-      perror("malloc");
-      exit(1);
+    return;
   }
-  whole_name[0] = '\0';
-  // String to let the player know it was an invalid name.
-  char *valid_name_msg = "Please, enter a valid name.\r\n";
-  // String to let the players a new player has joined.
-  char join[MAX_BUF];
 
-  int inbuf, room, len_guess, len, where;
-  int newline_flag = 1;
-  int red_flag = 1;
-  int disconnect_flag = 1;
+  // A new player entering their name. Anything sent after a name has been
+  // accepted, while the player waits for a seat, is dropped.
+  if (p->name[0] != '\0') {
+    return;
+  }
+  while (len > 0) {
+    int n = append_input(p, buf, len);
+    buf += n;
+    len -= n;
+    while (next_line(p, line)) {
+      // Once the player has a name (or is watching) they are no longer
+      // a new player; anything else they sent with it is dropped.
+      if (line_allowed(p) && handle_client_name(p, new_player_list, line)) {
+        return;
+      }
+    }
+  }
+}
 
-  // Select and read till we encounter a newline.
-  while (newline_flag == 1) {
-    inbuf = 0;
-    room = sizeof(p->inbuf);
+/*
+ * Tell a spectator that their input is ignored. Spectators cannot guess.
+ */
+void handle_spectator_line(struct client *p) {
+  char *spectator_msg = "You are spectating; guesses are ignored.\r\n";
+  send_message(p, spectator_msg);
+}
 
-    len = read(p->fd, p->in_ptr, room);
-    // Disconnect if the player pressed CTRL-C.
-    if (len == 0) {
-        disconnect_flag = 0;
-        disconnect_newplayer(new_player_list, p);
-        break;
-    }
-    else if (len < 0) {
-      fprintf(stderr, "Read from client failed\n");
-      remove_player(new_player_list, p->fd);
-    }
-    inbuf += len;
+/*
+ * Handle one line of input (a guess) from an active player.
+ */
+void handle_client_guess(struct client *p, struct game_state *game,
+                         char *line) {
+  struct game_events ev;
 
-    if ((where = find_network_newline(p->inbuf, inbuf)) < 0) {
-        newline_flag = 1;
-        room -= len;
-    }
-    else {
-      newline_flag = 0;
-    }
-    strncat(whole_name, p->inbuf, room);
-    room -= len;
+  // Anyone in the game can ask for a hint, whoever's turn it is.
+  if (strcmp(line, HINT_CMD) == 0) {
+    send_hint(p, game);
+    return;
   }
-  // Add a null terminator to the whole name inputted by user.
-  if (newline_flag == 0) {
-    for (int i = 0; i < MAX_BUF; i++) {
-      if (!((whole_name[i] >= 'a' && whole_name[i] <= 'z')
-          || (whole_name[i] >= 'A' && whole_name[i] <= 'Z'))) {
-            whole_name[i] = '\0';
-            break;
-          }
-    }
-    len_guess = strlen(whole_name);
+  ev.n = 0;
+  game_guess(game, p, line, &ev);
+  play_events(game, &ev);
+}
+
+/*
+ * Handle one line of input (a name) from a new player. A valid name is
+ * claimed at once. A player coming back to a seat held for them since a
+ * restart gets it straight away; anyone else waits in the lobby to be
+ * seated with the rest of the pass's batch.
+ * Return 1 if the player is done entering a name, either to play or to
+ * spectate, and 0 if they still need to enter one.
+ */
+int handle_client_name(struct client *p, struct client **new_player_list,
+                       char *line) {
+  // String to let the player know it was an invalid name.
+  char *valid_name_msg = "Please, enter a valid name.\r\n";
+
+  // A new player may choose to watch instead of play.
+  if (strcmp(line, SPECTATE_CMD) == 0) {
+    make_spectator(new_player_list, p);
+    return 1;
   }
-  else {
-    whole_name[0] = '\0';
-    len_guess = strlen(whole_name);
-  }
-
-  // Process the name if the player has not disconnected.
-  if (disconnect_flag == 1) {
-    // Empty name.
-    if (len_guess == 0) {
-      p->inbuf[0] = '\0';
-      whole_name[0] = '\0';
-      if(write(p->fd, valid_name_msg, strlen(valid_name_msg)) == -1) {
-          fprintf(stderr, "Write to client failed\n");
-          disconnect_newplayer(new_player_list, p);
-      };
-    }
-    // Proper name format.
-    else if (len_guess > 0) {
-      // Check if any other player shares the same name.
-      if (check_name(whole_name, game) == 1) {
-        p->inbuf[0] = '\0';
-        whole_name[0] = '\0';
-        inbuf -= where;
-        if(write(p->fd, valid_name_msg, strlen(valid_name_msg)) == -1) {
-            fprintf(stderr, "Write to client failed\n");
-            disconnect_newplayer(new_player_list, p);
-        };
-      }
-      // Valid name.
-      else {
-        red_flag = 0;
-        printf("[%d] Read %d bytes\n", p->fd, inbuf);
-        inbuf -= where;
-        printf("[%d] Found newline %s\n", p->fd, whole_name);
-        p->inbuf[0] = '\0';
-      }
-    }
+
+  // Empty names, names that do not fit and names that another player
+  // already has are all rejected.
+  if (strlen(line) == 0 || strlen(line) >= MAX_NAME
+      || check_name(line) == 1) {
+    send_message(p, valid_name_msg);
+    return 0;
   }
-  // If it is a valid name, strcpy it to the player's name and then
-  // move the player to the active game list, announcing the player's
-  // arrival and displaying the gameboard to them.
-  if (red_flag == 0) {
-     strcpy(p->name, whole_name);
-     move_player(new_player_list, p, game, p->fd);
-     sprintf(join, "%s has just joined.\r\n", p->name);
-     broadcast(game, join);
-     if (count_players(game) == 1) {
-       game->has_next_turn = p;
-     }
-     display_game(game, p->fd);
-     announce_turn(game);
+
+  strcpy(p->name, line);
+  names_claim(p->name, p);
+  if (!reclaim_seat(new_player_list, p)) {
+    lobby_wait(&lobby, p);
   }
-  free(whole_name);
+  return 1;
 }
 
 /* Add a client to the head of the linked list
  */
 void add_player(struct client **top, int fd, struct in_addr addr) {
-    struct client *p = malloc(sizeof(struct client));
-
-    if (!p) {
-        perror("malloc");
-        exit(1);
-    }
+    struct client *p = pool_get(&client_pool);
 
     printf("Adding client %s\n", inet_ntoa(addr));
 
     p->fd = fd;
     p->ipaddr = addr;
+    p->room = NULL;
+    p->watching = 0;
     p->name[0] = '\0';
-    p->in_ptr = p->inbuf;
-    p->inbuf[0] = '\0';
+    p->inbuf = NULL;
+    p->inlen = 0;
+    init_queue(&p->out);
+    p->io = NULL;
+    p->dead = 0;
+    p->missed = 0;
+    p->pending = 0;
+    bucket_init(&p->lines, LINE_BURST);
+    if (fd >= 0) {
+        set_fd_client(fd, p);
+        connected_clients++;
+    }
+    pollset_stale = 1;
     p->next = *top;
     *top = p;
 }
 
 /* Removes client from the linked list and closes its socket.
- * Also removes socket descriptor from allset
  */
 void remove_player(struct client **top, int fd) {
     struct client **p;
@@ -702,9 +2866,8 @@ void remove_player(struct client **top, int fd) {
     if (*p) {
         struct client *t = (*p)->next;
         printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-        FD_CLR((*p)->fd, &allset);
-        close((*p)->fd);
-        free(*p);
+        close_client(*p);
+        free_client(*p);
         *p = t;
     } else {
         fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
@@ -713,6 +2876,18 @@ void remove_player(struct client **top, int fd) {
 }
 
 
+/*
+ * Print how to run the server and exit.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-b poll|uring] [-r recording | -p recording] "
+            "[-U upgrade socket | -J cluster socket] [-R seats] [-B players] "
+            "[-S checkpoint] [-D seconds [-G] [-K turns]] [-L] [-T] "
+            "<dictionary filename>\n"
+            "       %s -c cluster socket [-L]\n", prog, prog);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
     struct sigaction sa;
     sa.sa_handler = SIG_IGN;
@@ -722,106 +2897,192 @@ int main(int argc, char **argv) {
       perror("sigaction");
       exit(1);
     }
+    // SIGUSR1 dumps the memory counters and latency histograms.
+    sa.sa_handler = trace_signal;
+    if(sigaction(SIGUSR1, &sa, NULL) == -1) {
+      perror("sigaction");
+      exit(1);
+    }
 
-    int clientfd, maxfd, nready;
-    struct client *p;
-    struct sockaddr_in q;
-    fd_set rset;
-
-    if(argc != 2){
-        fprintf(stderr,"Usage: %s <dictionary filename>\n", argv[0]);
-        exit(1);
+    char *record_name = NULL;
+    char *replay_name = NULL;
+    char *upgrade_path = NULL;
+    char *coordinator_path = NULL;
+    char *backend_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:r:p:U:R:B:S:D:GK:LTc:J:")) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "uring") == 0) {
+                ring = mem_malloc(MEM_SERVER, sizeof(struct uring));
+                if (ring == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+            }
+            else if (strcmp(optarg, "poll") != 0) {
+                fprintf(stderr, "Unknown backend %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            record_name = optarg;
+            break;
+        case 'p':
+            replay_name = optarg;
+            break;
+        case 'U':
+            upgrade_path = optarg;
+            break;
+        case 'R':
+            lobby.seats = strtol(optarg, NULL, 10);
+            if (lobby.seats < 1 || lobby.seats > MAX_ROOM_PLAYERS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'B':
+            bot_target = strtol(optarg, NULL, 10);
+            break;
+        case 'S':
+            checkpoint.path = optarg;
+            break;
+        case 'D':
+            turn_deadline = strtol(optarg, NULL, 10);
+            if (turn_deadline < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'G':
+            turn_costs_guess = 1;
+            break;
+        case 'K':
+            kick_after = strtol(optarg, NULL, 10);
+            if (kick_after < 0 || kick_after > 255) {
+                usage(argv[0]);
+            }
+            break;
+        case 'L':
+            ratelimit_enabled = 0;
+            break;
+        case 'T':
+            tracing = 1;
+            break;
+        case 'c':
+            coordinator_path = optarg;
+            break;
+        case 'J':
+            backend_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    timer_list_init(&turn_timers, turn_deadline * 1000000L);
+    // The coordinator only places players; it needs no dictionary.
+    if (coordinator_path != NULL) {
+        if (optind != argc) {
+            usage(argv[0]);
+        }
+        struct sockaddr_in server;
+        init_server_addr(&server, PORT);
+        run_coordinator(coordinator_path,
+                        set_up_server_socket(&server, MAX_QUEUE));
+        return 0;
+    }
+    if(optind != argc - 1 || (record_name != NULL && replay_name != NULL)){
+        usage(argv[0]);
     }
+    // A handoff passes the listening socket, which a backend does not have.
+    if (upgrade_path != NULL && backend_path != NULL) {
+        usage(argv[0]);
+    }
+    char *dict_name = argv[optind];
 
-    // Create and initialize the game state
-    struct game_state game;
+    // Fall back to poll if this kernel cannot run the io_uring backend.
+    if (ring != NULL && uring_init(ring, URING_ENTRIES) == -1) {
+        fprintf(stderr, "io_uring unavailable, using poll\n");
+        mem_free(ring);
+        ring = NULL;
+    }
 
-    srandom((unsigned int)time(NULL));
-    // Set up the file pointer outside of init_game because we want to
-    // just rewind the file when we need to pick a new word
-    game.dict.fp = NULL;
-    game.dict.size = get_file_length(argv[1]);
+    // Every room picks its words from the same open dictionary, rewinding
+    // it for each new game.
+    lobby.dict.fp = fopen(dict_name, "r");
+    if (lobby.dict.fp == NULL) {
+        perror("Opening dictionary");
+        exit(1);
+    }
+    lobby.dict.size = get_file_length(dict_name);
 
-    init_game(&game, argv[1]);
+    // Every word is picked with random(), so a replay reuses the seed of
+    // the run it recorded.
+    unsigned int seed = (unsigned int)time(NULL);
+    FILE *replay = NULL;
+    if (replay_name != NULL) {
+        int recorded_size;
+        replay = replay_open(replay_name, &seed, &recorded_size);
+        if (recorded_size != lobby.dict.size) {
+            fprintf(stderr, "%s was recorded with a %d word dictionary, "
+                    "not %d\n", replay_name, recorded_size, lobby.dict.size);
+            exit(1);
+        }
+    }
+    if (record_name != NULL) {
+        record_open(record_name, seed, lobby.dict.size);
+    }
+    srandom(seed);
 
-    // head and has_next_turn also don't change when a subsequent game is
-    // started so we initialize them here.
-    game.head = NULL;
-    game.has_next_turn = NULL;
+    solver_init(&engine, dict_name);
 
     /* A list of client who have not yet entered their name.  This list is
      * kept separate from the list of active players in the game, because
      * until the new playrs have entered a name, they should not have a turn
      * or receive broadcast messages.  In other words, they can't play until
-     * they have a name.
+     * they have a name. Rooms are opened as players arrive.
      */
     struct client *new_players = NULL;
 
-    struct sockaddr_in *server = init_server_addr(PORT);
-    int listenfd = set_up_server_socket(server, MAX_QUEUE);
-
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
-
-    while (1) {
-        // make a copy of the set before we pass it into select
-        rset = allset;
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        if (nready == -1) {
-            perror("select");
-            continue;
-        }
-
-        if (FD_ISSET(listenfd, &rset)){
-            printf("A new client is connecting\n");
-            clientfd = accept_connection(listenfd);
+    // A replay neither restores nor takes checkpoints.
+    if (replay != NULL) {
+        checkpoint.path = NULL;
+        run_replay(replay, &new_players);
+        return 0;
+    }
 
-            FD_SET(clientfd, &allset);
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
-            }
-            printf("Connection from %s\n", inet_ntoa(q.sin_addr));
-            add_player(&new_players, clientfd, q.sin_addr);
-            char *greeting = WELCOME_MSG;
-            if(write(clientfd, greeting, strlen(greeting)) == -1) {
-                fprintf(stderr, "Write to client %s failed\n", inet_ntoa(q.sin_addr));
-                remove_player(&new_players, clientfd);
-            };
+    // If a server is already running with the same upgrade socket, take
+    // its place without dropping anyone; otherwise start from scratch.
+    int listenfd;
+    int sock = upgrade_path != NULL ? upgrade_connect(upgrade_path) : -1;
+    if (backend_path != NULL) {
+        cluster_fd = upgrade_connect(backend_path);
+        if (cluster_fd == -1) {
+            fprintf(stderr, "No cluster coordinator on %s\n", backend_path);
+            exit(1);
         }
+        printf("Joined the cluster on %s\n", backend_path);
+        listenfd = -1;
+    }
+    else if (sock != -1) {
+        listenfd = take_over(sock, &new_players);
+    }
+    else {
+        struct sockaddr_in server;
+        init_server_addr(&server, PORT);
+        listenfd = set_up_server_socket(&server, MAX_QUEUE);
+    }
+    if (upgrade_path != NULL) {
+        upgrade_fd = upgrade_listen(upgrade_path);
+    }
+    // A server that took over has the rooms already.
+    if (sock == -1 && checkpoint.path != NULL) {
+        restore_checkpoint();
+    }
 
-        /* Check which other socket descriptors have something ready to read.
-         * The reason we iterate over the rset descriptors at the top level and
-         * search through the two lists of clients each time is that it is
-         * possible that a client will be removed in the middle of one of the
-         * operations. This is also why we call break after handling the input.
-         * If a client has been removed the loop variables may not longer be
-         * valid.
-         */
-        int cur_fd;
-        for(cur_fd = 0; cur_fd <= maxfd; cur_fd++) {
-            if(FD_ISSET(cur_fd, &rset)) {
-                // Check if this socket descriptor is an active player
-                for(p = game.head; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-                        handle_client_guess(p, &game);
-                        break;
-                    }
-                }
-
-                // Check if any new players are entering their names
-                for(p = new_players; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-                        // Handle client's name and whether it's acceptable.
-                        handle_client_name(p, &new_players, &game);
-                        break;
-                    }
-                }
-            }
-        }
+    if (ring != NULL) {
+        run_uring_loop(listenfd, &new_players);
+    }
+    else {
+        run_poll_loop(listenfd, &new_players);
     }
     return 0;
 }